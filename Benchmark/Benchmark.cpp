@@ -0,0 +1,442 @@
+#include "DerivativeCache.h"
+#include "FlatExp.h"
+#include "Incremental.h"
+#include "Serialize.h"
+#include "Sparse.h"
+#include "SymExp.h"
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Counts every heap allocation of the process, including the chunks of NodePool.
+namespace
+{
+	std::atomic<std::size_t> allocations{ 0 };
+}
+
+void* operator new(std::size_t size)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+
+
+namespace
+{
+	using Clock = std::chrono::steady_clock;
+
+	constexpr auto min_time = std::chrono::milliseconds(200);
+
+	std::string filter;
+
+	// Defeats dead code elimination of benchmark results.
+	const void* volatile sink;
+
+	template <typename T>
+	void Keep(const T& value)
+	{
+		sink = &value;
+	}
+
+	// Runs 'body' until 'min_time' has passed, then reports the means per iteration.
+	// The peak node count covers the nodes alive before the run plus everything 'body' creates.
+	template <typename Body>
+	void Run(const std::string& name, Body&& body)
+	{
+		if (name.find(filter) == std::string::npos)
+			return;
+
+		body(); // warm up caches and the node pool
+		AST::PeakNodeCount(true);
+		const std::size_t allocations_before = allocations.load();
+		const auto start = Clock::now();
+		std::size_t iterations = 0;
+		Clock::duration elapsed;
+		do
+		{
+			body();
+			iterations++;
+			elapsed = Clock::now() - start;
+		} while (elapsed < min_time);
+		const std::size_t allocated = allocations.load() - allocations_before;
+
+		const double ns = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+		std::cout << std::left << std::setw(36) << name << std::right
+			<< std::setw(12) << iterations
+			<< std::setw(16) << std::fixed << std::setprecision(0) << ns
+			<< std::setw(14) << std::setprecision(1) << static_cast<double>(allocated) / iterations
+			<< std::setw(12) << AST::PeakNodeCount()
+			<< std::endl;
+	}
+
+	std::vector<Var> Vars(std::size_t n)
+	{
+		std::vector<Var> vars;
+		vars.reserve(n);
+		for (std::size_t i = 0; i < n; i++)
+			vars.emplace_back("x" + std::to_string(i));
+		return vars;
+	}
+
+	std::vector<float> Values(std::size_t n)
+	{
+		std::vector<float> values(n);
+		for (std::size_t i = 0; i < n; i++)
+			values[i] = 0.5f + 0.25f * static_cast<float>(i % 7) / 7.0f;
+		return values;
+	}
+
+	// Balanced sum, keeps the tree depth logarithmic in the number of terms.
+	SymExp Sum(std::vector<SymExp> terms)
+	{
+		while (terms.size() > 1)
+		{
+			std::vector<SymExp> next;
+			next.reserve(terms.size() / 2 + 1);
+			for (std::size_t i = 0; i + 1 < terms.size(); i += 2)
+				next.push_back(terms[i] + terms[i + 1]);
+			if (terms.size() % 2)
+				next.push_back(terms.back());
+			terms = std::move(next);
+		}
+		return terms.front();
+	}
+
+	// Horner form of a polynomial of degree 'depth'.
+	SymExp PolynomialChain(const Var& x, std::size_t depth)
+	{
+		SymExp f = x;
+		for (std::size_t i = 1; i < depth; i++)
+			f = f * x + SymExp(static_cast<float>(i % 5));
+		return f;
+	}
+
+	// 'depth' levels of nested pow, exp and log.
+	// Each level uses the previous one twice, so the expanded tree grows exponentially.
+	SymExp Transcendental(const Var& x, const Var& y, std::size_t depth)
+	{
+		SymExp f = x;
+		for (std::size_t i = 0; i < depth; i++)
+			f = log(exp(f * SymExp(0.5f)) + pow(y, f * SymExp(0.25f)));
+		return f;
+	}
+
+	// Coupled terms, so the gradient depends on neighbouring variables.
+	SymExp WideSum(const std::vector<Var>& vars)
+	{
+		std::vector<SymExp> terms;
+		terms.reserve(vars.size());
+		for (std::size_t i = 0; i < vars.size(); i++)
+			terms.push_back(vars[i] * vars[(i + 1) % vars.size()] + exp(vars[i] * SymExp(0.1f)));
+		return Sum(std::move(terms));
+	}
+
+	void Polynomial()
+	{
+		Var x("x");
+		for (std::size_t depth : { 10, 100, 1000 })
+		{
+			const auto suffix = "/" + std::to_string(depth);
+			Run("Polynomial.Build" + suffix, [&] { Keep(PolynomialChain(x, depth)); });
+			const SymExp f = PolynomialChain(x, depth);
+			Run("Polynomial.Derive" + suffix, [&] { Keep(f.Derive(x)); });
+			Run("Polynomial.DeriveSimplify" + suffix, [&] { Keep(f.Derive(x).Simplify()); });
+			Run("Polynomial.At" + suffix, [&] { Keep(f.At(x, 0.9f).value()); });
+		}
+	}
+
+	void Nested()
+	{
+		Var x("x"), y("y");
+		for (std::size_t depth : { 4, 8, 12 })
+		{
+			const auto suffix = "/" + std::to_string(depth);
+			const SymExp f = Transcendental(x, y, depth);
+			Run("Nested.Derive" + suffix, [&] { Keep(f.Derive(x)); });
+			Run("Nested.Simplify" + suffix, [&] { Keep(f.Derive(x).Simplify()); });
+			Run("Nested.At" + suffix, [&] { Keep(f.At({ x, y }, { 0.7f, 1.3f }).value()); });
+		}
+	}
+
+	void Wide()
+	{
+		for (std::size_t n : { 10, 100, 1000, 10000 })
+		{
+			const auto suffix = "/" + std::to_string(n);
+			const auto vars = Vars(n);
+			const auto values = Values(n);
+			Run("Wide.Build" + suffix, [&] { Keep(WideSum(vars)); });
+			const SymExp f = WideSum(vars);
+			Run("Wide.Gradient" + suffix, [&] { Keep(f.Gradient(vars)); });
+			Run("Wide.GradientAt" + suffix, [&] { Keep(f.GradientAt(vars, values)); });
+			Run("Wide.At" + suffix, [&] { Keep(f.At(vars, values).value()); });
+			// One parameter bound in a large model, the rest of the tree is unsimplified.
+			Run("Wide.AtFirst" + suffix, [&] { Keep(f.At(vars.front(), 0.5f)); });
+			Run("Wide.PartialAtFirst" + suffix, [&] { Keep(f.PartialAt(vars.front(), 0.5f)); });
+
+			auto compiled = f.Compile(vars);
+			std::vector<float> gradient(n);
+			Run("Wide.Compiled" + suffix, [&] { Keep(compiled(values)); });
+			Run("Wide.CompiledGradient" + suffix, [&] { Keep(compiled.Gradient(values.data(), gradient.data())); });
+
+			// Eight directional derivatives, for example one Jacobian-vector product per column block.
+			std::vector<float> directions(n * 8, 1.0f), derivatives(8);
+			Run("Wide.CompiledDirectional" + suffix, [&] { Keep(compiled.Directional(values.data(), directions.data(), 8, derivatives.data())); });
+		}
+	}
+
+	// Left-leaning sums built term by term with 'operator+', as deep as they are long.
+	void Deep()
+	{
+		Var x("x"), y("y");
+		for (std::size_t n : { 1000, 100000 })
+		{
+			const auto suffix = "/" + std::to_string(n);
+			SymExp f = x;
+			for (std::size_t i = 1; i < n; i++)
+				f = f + (i % 2 ? x : y) * SymExp(static_cast<float>(i % 7));
+			Run("Deep.Derive" + suffix, [&] { Keep(f.Derive(x)); });
+			Run("Deep.Simplify" + suffix, [&] { Keep((f + x).Simplify()); });
+			Run("Deep.At" + suffix, [&] { Keep(f.At(x, 0.5f)); });
+			Run("Deep.ToString" + suffix, [&] { Keep(f.to_string()); });
+			Run("Deep.Compile" + suffix, [&] { Keep(f.Compile({ x, y }).size()); });
+		}
+	}
+
+	// One output per variable, each mentioning three of them.
+	void Sparse()
+	{
+		for (std::size_t n : { 100, 1000, 10000 })
+		{
+			const auto suffix = "/" + std::to_string(n);
+			const auto vars = Vars(n);
+			const auto values = Values(n);
+			std::vector<SymExp> outputs;
+			outputs.reserve(n);
+			for (std::size_t i = 0; i < n; i++)
+				outputs.push_back(vars[i] * vars[(i + 1) % n] + exp(vars[(i + 7) % n] * SymExp(0.1f)));
+			const SymExpVec f(std::move(outputs));
+			Run("Sparse.Pattern" + suffix, [&] { Keep(JacobianSparsity(f, vars).nonzeros()); });
+			Run("Sparse.Jacobian" + suffix, [&] { Keep(Jacobian(f, vars).nonzeros()); });
+			SparseJacobian jacobian(f, vars);
+			Run("Sparse.JacobianAt" + suffix, [&] { Keep(jacobian(values).values.front()); });
+		}
+	}
+
+	// Derivatives taken again, as when a gradient is followed by a Hessian and by more gradients.
+	void Cache()
+	{
+		Var x("x"), y("y");
+		const SymExp f = Transcendental(x, y, 12);
+		DerivativeCache nested;
+		Run("Cache.Derive/12", [&] { Keep(nested.Derive(f, x)); });
+		for (std::size_t n : { 10, 100 })
+		{
+			const auto suffix = "/" + std::to_string(n);
+			const auto vars = Vars(n);
+			const SymExp g = WideSum(vars);
+			Run("Cache.Hessian" + suffix, [&] { Keep(g.Gradient(vars).Derive(vars)); });
+			DerivativeCache wide;
+			Run("Cache.CachedHessian" + suffix, [&] { Keep(wide.Derive(wide.Derive(g, vars), vars)); });
+		}
+	}
+
+	// One input changing between evaluations, as in an optimizer updating a single coordinate.
+	void Incremental()
+	{
+		for (std::size_t n : { 100, 10000 })
+		{
+			const auto suffix = "/" + std::to_string(n);
+			const auto vars = Vars(n);
+			const auto values = Values(n);
+			const SymExp f = WideSum(vars);
+			IncrementalExp incremental(f, vars);
+			Keep(incremental(values));
+			std::size_t step = 0;
+			Run("Incremental.Value" + suffix, [&] {
+				incremental.Set(n / 2, step++ % 2 ? 0.5f : 0.25f);
+				Keep(incremental());
+			});
+			Run("Incremental.Gradient" + suffix, [&] {
+				incremental.Set(n / 2, step++ % 2 ? 0.5f : 0.25f);
+				Keep(incremental.Gradient().front());
+			});
+		}
+	}
+
+	// Startup of a worker: building and lowering the tree against mapping a saved tape.
+	void Loading()
+	{
+		const auto path = (std::filesystem::temp_directory_path() / "symexp_benchmark.bin").string();
+		for (std::size_t n : { 100, 10000 })
+		{
+			const auto suffix = "/" + std::to_string(n);
+			const auto vars = Vars(n);
+			const SymExp f = WideSum(vars);
+			MappedExp::Save(f, vars, path);
+			Run("Loading.BuildCompile" + suffix, [&] { Keep(WideSum(vars).Compile(vars).size()); });
+			Run("Loading.Compile" + suffix, [&] { Keep(f.Compile(vars).size()); });
+			Run("Loading.Map" + suffix, [&] { Keep(MappedExp(path).Compile().size()); });
+			Run("Loading.Rebuild" + suffix, [&] { Keep(MappedExp(path).Rebuild(vars)); });
+		}
+		std::filesystem::remove(path);
+	}
+
+	// Contracts the benchmarks rely on, checked before any timing. Exits with an error if one does not hold.
+	void Require(bool condition, const std::string& what)
+	{
+		if (condition)
+			return;
+		std::cerr << "Check failed: " << what << '\n';
+		std::exit(EXIT_FAILURE);
+	}
+
+	// Reading the text of 'to_string' gives back the same expression. Constants are chosen to print exactly.
+	void CheckParse()
+	{
+		Var x("x"), y("y");
+		const std::vector<SymExp> expressions = {
+			x,
+			SymExp(2.5f),
+			-x,
+			x + y * SymExp(3.0f) - x / y,
+			pow(x, SymExp(2.0f)) + exp(-y) * log(x),
+			Transcendental(x, y, 3),
+			Transcendental(x, y, 3).Derive(x),
+			PolynomialChain(x, 20).Derive(x),
+			WideSum(Vars(50)).Gradient(Vars(50)).begin()[7],
+		};
+		for (const SymExp& e : expressions)
+		{
+			const std::string text = e.to_string();
+			const SymExp parsed = SymExp::Parse(text);
+			Require(parsed == e, "Parse(e.to_string()) == e for " + text);
+			Require(parsed.to_string() == text, "Parse(text).to_string() == text for " + text);
+		}
+		// Anonymous symbols are written as '$N', which would read back as a new named symbol.
+		const std::string anonymous = (x * Var()).to_string();
+		bool rejected = false;
+		try
+		{
+			Keep(SymExp::Parse(anonymous));
+		}
+		catch (const std::invalid_argument&)
+		{
+			rejected = true;
+		}
+		Require(rejected, "Parse rejects the anonymous symbol in " + anonymous);
+	}
+
+	// A saved file loads as the same expression, with the same values and gradient.
+	void CheckSerialize()
+	{
+		const auto path = (std::filesystem::temp_directory_path() / "symexp_check.bin").string();
+		Var x("x"), y("y");
+		const std::vector<Var> vars = { x, y };
+		const std::vector<float> values = { 0.7f, 1.3f };
+		for (const SymExp& f : { Transcendental(x, y, 4), Transcendental(x, y, 4).Derive(y), PolynomialChain(x, 30) * y })
+		{
+			MappedExp::Save(f, vars, path);
+			const MappedExp mapped(path);
+			const std::string text = f.to_string();
+			Require(mapped.inputs() == vars.size() and mapped.name(0) == "x" and mapped.name(1) == "y", "inputs keep their names for " + text);
+			Require(mapped.vars()[0] == x and mapped.vars()[1] == y, "named inputs load as the saved Vars for " + text);
+			Require(mapped.Rebuild().Simplify() == f.Simplify(), "Rebuild() is the saved expression for " + text);
+
+			auto original = f.Compile(vars);
+			auto loaded = mapped.Compile();
+			Require(loaded(values) == original(values), "the loaded tape has the same value for " + text);
+			Require(loaded.Gradient(values) == original.Gradient(values), "the loaded tape has the same gradient for " + text);
+		}
+		{
+			Var a;
+			const SymExp f = x * a + exp(a);
+			MappedExp::Save(f, { x, a }, path);
+			const MappedExp mapped(path);
+			const auto loaded = mapped.vars();
+			Require(mapped.name(1).empty() and loaded[0] == x and loaded[1] != a and loaded[1] != mapped.vars()[1], "anonymous inputs load as new anonymous Vars");
+			Require(mapped.Rebuild({ x, a }).Simplify() == f.Simplify(), "Rebuild over the saved Vars restores anonymous inputs");
+		}
+		std::filesystem::remove(path);
+	}
+
+	void Printing()
+	{
+		Var x("x"), y("y");
+		for (std::size_t depth : { 10, 100, 200 })
+		{
+			const auto suffix = "/" + std::to_string(depth);
+			const SymExp f = PolynomialChain(x, depth).Derive(x);
+			Run("ToString.Polynomial" + suffix, [&] { Keep(f.to_string()); });
+			Run("WriteShared.Polynomial" + suffix, [&] { std::string text; f.WriteShared(text); Keep(text); });
+		}
+		const SymExp g = Transcendental(x, y, 8).Derive(x);
+		Run("ToString.Nested/8", [&] { Keep(g.to_string()); });
+		const auto vars = Vars(1000);
+		const SymExp h = WideSum(vars);
+		Run("ToString.Wide/1000", [&] { Keep(h.to_string()); });
+
+		const auto nested = g.to_string(), wide = h.to_string();
+		Run("Parse.Nested/8", [&] { Keep(SymExp::Parse(nested)); });
+		Run("Parse.Wide/1000", [&] { Keep(SymExp::Parse(wide)); });
+	}
+
+	// The same passes on the array of tagged nodes, against the node store.
+	void Flat()
+	{
+		Var x("x"), y("y");
+		for (std::size_t depth : { 4, 8, 12 })
+		{
+			const auto suffix = "/" + std::to_string(depth);
+			const SymExp f = Transcendental(x, y, depth);
+			const FlatExp flat(f);
+			Run("Flat.Convert" + suffix, [&] { Keep(FlatExp(f).size()); });
+			Run("Flat.Derive" + suffix, [&] { Keep(flat.Derive(x).size()); });
+			Run("Flat.Simplify" + suffix, [&] { Keep(flat.Derive(x).Simplify().size()); });
+			Run("Flat.Eval" + suffix, [&] { Keep(flat.Eval({ x, y }, { 0.7f, 1.3f })); });
+		}
+		const SymExp p = PolynomialChain(x, 1000);
+		const FlatExp flat(p);
+		Run("Flat.Polynomial/1000", [&] { Keep(flat.Derive(x).size()); });
+	}
+}
+
+// Usage: Benchmark [filter]
+// Runs every benchmark whose name contains 'filter'.
+int main(int argc, char* argv[])
+{
+	if (argc > 1)
+		filter = argv[1];
+
+	std::cout << std::left << std::setw(36) << "Benchmark" << std::right
+		<< std::setw(12) << "Iterations"
+		<< std::setw(16) << "ns/iteration"
+		<< std::setw(14) << "allocs/iter"
+		<< std::setw(12) << "peak nodes"
+		<< '\n';
+	CheckParse();
+	CheckSerialize();
+	Polynomial();
+	Nested();
+	Wide();
+	Deep();
+	Sparse();
+	Cache();
+	Incremental();
+	Loading();
+	Printing();
+	Flat();
+}
@@ -0,0 +1,199 @@
+#include "CodeGen.h"
+#include <charconv>
+#include <cmath>
+#include <unordered_map>
+
+namespace
+{
+	// Float literal that reads back to the same value.
+	std::string Literal(float value)
+	{
+		if (std::isnan(value))
+			return "NAN";
+		if (std::isinf(value))
+			return value > 0 ? "INFINITY" : "(-INFINITY)";
+		char text[32];
+		auto [end, ec] = std::to_chars(text, text + sizeof(text), value);
+		std::string ret(text, end);
+		if (ret.find_first_of(".e") == std::string::npos)
+			ret += ".0";
+		ret += 'f';
+		return std::signbit(value) ? "(" + ret + ")" : ret;
+	}
+
+	// 'value' as an exponent worth expanding into multiplications.
+	bool SmallPower(float value, int& power) noexcept
+	{
+		if (value != std::trunc(value) or std::abs(value) > CodeGen::max_unrolled_power)
+			return false;
+		power = static_cast<int>(value);
+		return true;
+	}
+
+	std::string Power(const std::string& base, int power)
+	{
+		if (power == 0)
+			return "1.0f";
+		std::string product = base;
+		for (int i = 1; i < std::abs(power); i++)
+			product += " * " + base;
+		return power > 0 ? product : "1.0f / (" + product + ")";
+	}
+}
+
+CodeGen::CodeGen(Tape&& tape, std::uint32_t result) noexcept
+	: CodeGen(std::move(tape), std::vector<std::uint32_t>{ result })
+{
+	scalar = true;
+}
+
+CodeGen::CodeGen(Tape&& tape, std::vector<std::uint32_t> results) noexcept
+	: instructions(std::move(tape.instructions))
+	, constants(std::move(tape.constants))
+	, results(std::move(results))
+	, input_size(tape.inputs.size())
+	, scalar(false)
+{}
+
+std::string CodeGen::Name(std::uint32_t slot) const
+{
+	const Instruction& ins = instructions[slot];
+	return ins.op == OpCode::Value ? Literal(constants[ins.l]) : "t" + std::to_string(slot);
+}
+
+void CodeGen::Body(std::string& out, bool cuda) const
+{
+	const std::size_t size = instructions.size();
+	const bool returns = scalar and not cuda; // the value is returned instead of stored to 'y'
+	auto element = [&](const char* array, std::size_t index) {
+		return std::string(array) + "[" + std::to_string(index) + (cuda ? " * n + row]" : "]");
+	};
+	auto power = [&](const Instruction& ins, int& p) {
+		return instructions[ins.r].op == OpCode::Value and SmallPower(constants[instructions[ins.r].l], p);
+	};
+
+	// Forward pass, one local per instruction.
+	std::vector<bool> active(size); // depends on an input
+	std::vector<std::uint32_t> input_slots(input_size, UINT32_MAX);
+	std::unordered_map<std::uint32_t, std::uint32_t> logs; // operand -> slot of its log
+	for (std::uint32_t i = 0; i < size; i++)
+	{
+		const Instruction& ins = instructions[i];
+		// 'l' of 'Value' and 'Input' indexes the constants and inputs, only operations have operand slots.
+		const bool binary = ins.op >= OpCode::Add and ins.op <= OpCode::Pow;
+		const bool leaf = ins.op == OpCode::Value or ins.op == OpCode::Input;
+		const auto l = leaf ? std::string() : Name(ins.l), r = binary ? Name(ins.r) : std::string();
+		std::string value;
+		int p;
+		switch (ins.op)
+		{
+			case OpCode::Value: continue;
+			case OpCode::Input: value = element("x", ins.l); input_slots[ins.l] = i; break;
+			case OpCode::Neg: value = "-" + l; break;
+			case OpCode::Add: value = l + " + " + r; break;
+			case OpCode::Sub: value = l + " - " + r; break;
+			case OpCode::Mul: value = l + " * " + r; break;
+			case OpCode::Div: value = l + " / " + r; break;
+			case OpCode::Pow: value = power(ins, p) ? Power(l, p) : "powf(" + l + ", " + r + ")"; break;
+			case OpCode::Exp: value = "expf(" + l + ")"; break;
+			case OpCode::Log: value = "logf(" + l + ")"; logs.emplace(ins.l, i); break;
+		}
+		active[i] = ins.op == OpCode::Input or active[ins.l] or (binary and active[ins.r]);
+		out += "\tconst float t" + std::to_string(i) + " = " + value + ";\n";
+	}
+	if (not returns)
+		for (std::size_t k = 0; k < results.size(); k++)
+			out += "\t" + element("y", k) + " = " + Name(results[k]) + ";\n";
+
+	// One reverse sweep per result.
+	const char* derivatives = returns ? "grad" : "jacobian";
+	out += "\n\tif (" + std::string(derivatives) + ")\n\t{\n";
+	for (std::size_t k = 0; k < results.size(); k++)
+	{
+		const std::uint32_t result = results[k];
+		std::vector<bool> needed(size);
+		needed[result] = true;
+		std::string sweep;
+		for (std::uint32_t i = result + 1; i-- > 0;)
+		{
+			const Instruction& ins = instructions[i];
+			if (not needed[i] or not active[i] or ins.op == OpCode::Input)
+				continue;
+			// Leaves were skipped above, so 'l' is a slot. 'r' is one for binary operations only.
+			const bool binary = ins.op >= OpCode::Add and ins.op <= OpCode::Pow;
+			const auto a = "a" + std::to_string(i), v = Name(i), l = Name(ins.l), r = binary ? Name(ins.r) : std::string();
+			const auto al = "a" + std::to_string(ins.l), ar = "a" + std::to_string(ins.r);
+			std::string dl, dr; // contributions to the operands' adjoints
+			int p;
+			switch (ins.op)
+			{
+				case OpCode::Value: case OpCode::Input: break;
+				case OpCode::Neg: dl = al + " -= " + a; break;
+				case OpCode::Add: dl = al + " += " + a; dr = ar + " += " + a; break;
+				case OpCode::Sub: dl = al + " += " + a; dr = ar + " -= " + a; break;
+				case OpCode::Mul: dl = al + " += " + a + " * " + r; dr = ar + " += " + a + " * " + l; break;
+				case OpCode::Div: dl = al + " += " + a + " / " + r; dr = ar + " -= " + a + " * " + v + " / " + r; break;
+				case OpCode::Pow:
+					if (not power(ins, p))
+					{
+						auto log = logs.find(ins.l); // reuse the log of the base when it is computed anyway
+						// As PowPartial, zero for an exponent of 0 even where powf(base, -1) is infinite.
+						dl = al + " += " + a + " * (" + r + " == 0.0f ? 0.0f : " + r + " * powf(" + l + ", " + r + " - 1.0f))";
+						dr = ar + " += " + a + " * " + v + " * " + (log != logs.end() ? Name(log->second) : "logf(" + l + ")");
+					}
+					else if (p != 0)
+						dl = al + " += " + a + (p == 1 ? "" : " * " + Literal(static_cast<float>(p)) + " * (" + Power(l, p - 1) + ")");
+					break;
+				case OpCode::Exp: dl = al + " += " + a + " * " + v; break;
+				case OpCode::Log: dl = al + " += " + a + " / " + l; break;
+			}
+			if (active[ins.l] and not dl.empty())
+			{
+				needed[ins.l] = true;
+				sweep += "\t\t\t" + dl + ";\n";
+			}
+			if (binary and active[ins.r] and not dr.empty())
+			{
+				needed[ins.r] = true;
+				sweep += "\t\t\t" + dr + ";\n";
+			}
+		}
+
+		out += "\t\t{\n";
+		for (std::uint32_t i = 0; i <= result; i++)
+			if (needed[i] and active[i])
+				out += "\t\t\tfloat a" + std::to_string(i) + (i == result ? " = 1.0f;\n" : " = 0.0f;\n");
+		out += sweep;
+		for (std::size_t j = 0; j < input_size; j++)
+		{
+			const std::uint32_t slot = input_slots[j];
+			const bool used = slot != UINT32_MAX and slot <= result and needed[slot];
+			out += "\t\t\t" + element(derivatives, k * input_size + j) + " = " + (used ? "a" + std::to_string(slot) : "0.0f") + ";\n";
+		}
+		out += "\t\t}\n";
+	}
+	out += "\t}\n";
+}
+
+std::string CodeGen::Cpp(const std::string& name) const
+{
+	// MSVC exports nothing from a DLL unless asked, so the function is marked for Jit to find it.
+	std::string out = "#include <math.h>\n\n"
+		"#ifdef _WIN32\n#define SYMEXP_EXPORT __declspec(dllexport)\n#else\n#define SYMEXP_EXPORT\n#endif\n\n"
+		"#ifdef __cplusplus\nextern \"C\"\n#endif\n";
+	out += scalar
+		? "SYMEXP_EXPORT float " + name + "(const float* x, float* grad)\n{\n"
+		: "SYMEXP_EXPORT void " + name + "(const float* x, float* y, float* jacobian)\n{\n";
+	Body(out, false);
+	if (scalar)
+		out += "\treturn " + Name(results.front()) + ";\n";
+	return out + "}\n";
+}
+
+std::string CodeGen::Cuda(const std::string& name) const
+{
+	std::string out = "extern \"C\" __global__ void " + name + "(const float* x, float* y, float* jacobian, size_t n)\n{\n";
+	out += "\tconst size_t row = blockIdx.x * (size_t)blockDim.x + threadIdx.x;\n\tif (row >= n)\n\t\treturn;\n\n";
+	Body(out, true);
+	return out + "}\n";
+}
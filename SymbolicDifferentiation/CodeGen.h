@@ -0,0 +1,40 @@
+#pragma once
+#include "CompiledExp.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Emits standalone C/C++ and CUDA source computing a SymExp or SymExpVec and its derivatives.
+// Every shared subexpression is computed once into a local, the derivatives reuse the values
+// of the forward pass, and 'pow' with a small integer exponent is expanded into multiplications.
+class CodeGen
+{
+	std::vector<Instruction> instructions;
+	std::vector<float> constants;
+	std::vector<std::uint32_t> results; // slot of each result
+	std::size_t input_size;
+	bool scalar; // generated from a SymExp
+
+	[[nodiscard]] std::string Name(std::uint32_t slot) const; // local or literal holding the slot
+	void Body(std::string& out, bool cuda) const;
+public:
+	// Integer exponents up to this magnitude are expanded.
+	static constexpr int max_unrolled_power = 8;
+
+	CodeGen(Tape&&, std::uint32_t result) noexcept;
+	CodeGen(Tape&&, std::vector<std::uint32_t> results) noexcept;
+
+	[[nodiscard]] std::size_t inputs() const noexcept { return input_size; }
+	[[nodiscard]] std::size_t outputs() const noexcept { return results.size(); }
+
+	// A SymExp gives 'float name(const float* x, float* grad)', returning the value.
+	// A SymExpVec gives 'void name(const float* x, float* y, float* jacobian)', the Jacobian row-major.
+	// 'x' holds one value per Var, in the order passed to 'Generate'. Derivatives are skipped when their pointer is null.
+	// The function has C linkage, is exported from a DLL on Windows, and is valid C as well as C++.
+	[[nodiscard]] std::string Cpp(const std::string& name) const;
+
+	// Kernel 'void name(const float* x, float* y, float* jacobian, size_t n)' evaluating 'n' rows, one per thread,
+	// in the structure-of-arrays layout of CompiledExp::Batch: input j of row i is 'x[j * n + i]', result k is
+	// 'y[k * n + i]' and its partial derivative j is 'jacobian[(k * inputs + j) * n + i]'.
+	[[nodiscard]] std::string Cuda(const std::string& name) const;
+};
@@ -0,0 +1,420 @@
+#include "CompiledExp.h"
+#include "SymExp.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <bit>
+#include <cstdint>
+#include <stdexcept>
+
+namespace
+{
+	// Cephes single precision approximations.
+	// Written without branches so loops over them auto-vectorize.
+
+	inline float VecExp(float x) noexcept
+	{
+		const float c = x < -87.33654f ? -87.33654f : (x > 88.72283f ? 88.72283f : x);
+		const float n = (c * 1.44269504088896341f + 12582912.0f) - 12582912.0f; // round to nearest
+		const float r = c - n * 0.693359375f - n * -2.12194440e-4f;
+		float p = 1.9875691500e-4f;
+		p = p * r + 1.3981999507e-3f;
+		p = p * r + 8.3334519073e-3f;
+		p = p * r + 4.1665795894e-2f;
+		p = p * r + 1.6666665459e-1f;
+		p = p * r + 5.0000001201e-1f;
+		p = p * r * r + r + 1.0f;
+
+		// 2^n with n in [-126, 128], the top exponent is applied in two steps so it stays finite.
+		const bool top = n > 127.0f;
+		const float scale = std::bit_cast<float>((static_cast<std::int32_t>(top ? n - 1.0f : n) + 127) << 23);
+		const float ret = p * scale * (top ? 2.0f : 1.0f);
+
+		// Overflows to infinity, flushes the denormal range to zero and propagates NaN.
+		return x > 88.72283f ? std::numeric_limits<float>::infinity() : (x < -87.33654f ? 0.0f : (x != x ? x : ret));
+	}
+
+	inline float VecLog(float x) noexcept
+	{
+		// Every operation is evaluated unconditionally and combined by selects, so the compiler can if-convert.
+		const bool denormal = x < 1.17549435e-38f;
+		const float scaled = x * 8388608.0f;
+		const float y = denormal ? scaled : x;
+		const std::int32_t bits = std::bit_cast<std::int32_t>(y);
+		float e = static_cast<float>((bits >> 23) - 126) - (denormal ? 23.0f : 0.0f);
+		float m = std::bit_cast<float>((bits & 0x007fffff) | 0x3f000000); // [0.5, 1)
+		const bool small = m < 0.707106781186547524f;
+		e = small ? e - 1.0f : e;
+		m = small ? m + m - 1.0f : m - 1.0f;
+
+		const float z = m * m;
+		float p = 7.0376836292e-2f;
+		p = p * m - 1.1514610310e-1f;
+		p = p * m + 1.1676998740e-1f;
+		p = p * m - 1.2420140846e-1f;
+		p = p * m + 1.4249322787e-1f;
+		p = p * m - 1.6668057665e-1f;
+		p = p * m + 2.0000714765e-1f;
+		p = p * m - 2.4999993993e-1f;
+		p = p * m + 3.3333331174e-1f;
+		p = p * m * z;
+		p += e * -2.12194440e-4f;
+		p -= 0.5f * z;
+		const float ret = m + p + e * 0.693359375f;
+
+		const bool zero = x == 0.0f;
+		const bool invalid = (x < 0.0f) | (x != x);
+		const bool infinite = x == std::numeric_limits<float>::infinity();
+		const float special = zero ? -std::numeric_limits<float>::infinity() : (invalid ? std::numeric_limits<float>::quiet_NaN() : x);
+		return zero | invalid | infinite ? special : ret;
+	}
+
+	// Sign and special cases of pow(x, y) given r = exp(y * log(|x|)).
+	inline float VecPowFixup(float x, float y, float r) noexcept
+	{
+		const bool large = std::fabs(y) >= 16777216.0f; // always an even integer
+		const std::int32_t i = static_cast<std::int32_t>(large ? 0.0f : y);
+		const bool integer = large | (static_cast<float>(i) == y);
+		const bool odd = integer & ((i & 1) != 0);
+		const float negative = integer ? (odd ? -r : r) : std::numeric_limits<float>::quiet_NaN();
+		return (y == 0.0f) | (x == 1.0f) ? 1.0f : (x < 0.0f ? negative : r);
+	}
+
+	// Three passes over the lanes, so each loop stays small enough to vectorize.
+	// 'd' must not alias 'y'.
+	inline void VecPow(const float* x, const float* y, float* d, std::size_t count) noexcept
+	{
+		for (std::size_t k = 0; k < count; k++) d[k] = VecLog(std::fabs(x[k]));
+		for (std::size_t k = 0; k < count; k++) d[k] = VecExp(y[k] * d[k]);
+		for (std::size_t k = 0; k < count; k++) d[k] = VecPowFixup(x[k], y[k], d[k]);
+	}
+}
+
+Tape::Tape(const std::vector<const AST::Symbol*>& symbols)
+{
+	for (std::size_t i = 0; i < symbols.size(); i++)
+		inputs.emplace(symbols[i]->id(), static_cast<std::uint32_t>(i));
+}
+
+std::uint32_t Tape::Compile(const AST::Node& node)
+{
+	auto it = compiled.find(&node);
+	if (it != compiled.end())
+		return it->second;
+	// Operands first, so the nested calls of each node find their slots here.
+	AST::Traverse(node,
+		[this](const AST::Node* n) { return not compiled.contains(n); },
+		[this](const AST::Node* n) { compiled.emplace(n, n->Compile(*this)); });
+	return compiled.at(&node);
+}
+
+std::uint32_t Tape::Emit(OpCode op, std::uint32_t l, std::uint32_t r)
+{
+	instructions.push_back({ op, l, r });
+	return static_cast<std::uint32_t>(instructions.size() - 1);
+}
+
+std::uint32_t Tape::Value(float value)
+{
+	constants.push_back(value);
+	return Emit(OpCode::Value, static_cast<std::uint32_t>(constants.size() - 1));
+}
+
+std::uint32_t Tape::Input(const AST::Symbol& s)
+{
+	auto it = inputs.find(s.id());
+	if (it == inputs.end())
+		throw std::invalid_argument("Unbound symbol '" + s.to_string() + "' in SymExp::Compile.");
+	return Emit(OpCode::Input, it->second);
+}
+
+
+CompiledExp::CompiledExp(Tape&& tape) noexcept
+	: input_size(tape.inputs.size())
+{
+	struct Storage
+	{
+		std::vector<Instruction> instructions;
+		std::vector<float> constants;
+	};
+	auto owned = std::make_shared<const Storage>(std::move(tape.instructions), std::move(tape.constants));
+	instructions = owned->instructions;
+	constants = owned->constants;
+	storage = std::move(owned);
+	slots.resize(instructions.size());
+	adjoints.resize(instructions.size());
+}
+
+CompiledExp::CompiledExp(std::shared_ptr<const void> storage, std::span<const Instruction> instructions, std::span<const float> constants, std::size_t input_size)
+	: storage(std::move(storage))
+	, instructions(instructions)
+	, constants(constants)
+	, slots(instructions.size())
+	, adjoints(instructions.size())
+	, input_size(input_size)
+{}
+
+void CompiledExp::Forward(const float* inputs) noexcept
+{
+	float* s = slots.data();
+	for (std::size_t i = 0; i < instructions.size(); i++)
+	{
+		const Instruction& ins = instructions[i];
+		switch (ins.op)
+		{
+			case OpCode::Value: s[i] = constants[ins.l]; break;
+			case OpCode::Input: s[i] = inputs[ins.l]; break;
+			case OpCode::Neg: s[i] = -s[ins.l]; break;
+			case OpCode::Add: s[i] = s[ins.l] + s[ins.r]; break;
+			case OpCode::Sub: s[i] = s[ins.l] - s[ins.r]; break;
+			case OpCode::Mul: s[i] = s[ins.l] * s[ins.r]; break;
+			case OpCode::Div: s[i] = s[ins.l] / s[ins.r]; break;
+			case OpCode::Pow: s[i] = std::pow(s[ins.l], s[ins.r]); break;
+			case OpCode::Exp: s[i] = std::exp(s[ins.l]); break;
+			case OpCode::Log: s[i] = std::log(s[ins.l]); break;
+		}
+	}
+}
+
+float CompiledExp::operator()(const float* inputs) noexcept
+{
+	Forward(inputs);
+	return slots.back();
+}
+
+float CompiledExp::operator()(const std::vector<float>& inputs) noexcept
+{
+	assert(inputs.size() == input_size);
+	return operator()(inputs.data());
+}
+
+float CompiledExp::Gradient(const float* inputs, float* gradient) noexcept
+{
+	Forward(inputs);
+
+	const float* s = slots.data();
+	float* a = adjoints.data();
+	std::fill(adjoints.begin(), adjoints.end(), 0.0f);
+	std::fill(gradient, gradient + input_size, 0.0f);
+	adjoints.back() = 1;
+	for (std::size_t i = instructions.size(); i-- > 0;)
+	{
+		const Instruction& ins = instructions[i];
+		switch (ins.op)
+		{
+			case OpCode::Value: break;
+			case OpCode::Input: gradient[ins.l] += a[i]; break;
+			case OpCode::Neg: a[ins.l] -= a[i]; break;
+			case OpCode::Add: a[ins.l] += a[i]; a[ins.r] += a[i]; break;
+			case OpCode::Sub: a[ins.l] += a[i]; a[ins.r] -= a[i]; break;
+			case OpCode::Mul: a[ins.l] += a[i] * s[ins.r]; a[ins.r] += a[i] * s[ins.l]; break;
+			case OpCode::Div: a[ins.l] += a[i] / s[ins.r]; a[ins.r] -= a[i] * s[i] / s[ins.r]; break;
+			case OpCode::Pow:
+				a[ins.l] += a[i] * PowPartial(s[ins.l], s[ins.r]);
+				a[ins.r] += a[i] * s[i] * std::log(s[ins.l]);
+				break;
+			case OpCode::Exp: a[ins.l] += a[i] * s[i]; break;
+			case OpCode::Log: a[ins.l] += a[i] / s[ins.l]; break;
+		}
+	}
+	return slots.back();
+}
+
+std::vector<float> CompiledExp::Gradient(const std::vector<float>& inputs)
+{
+	assert(inputs.size() == input_size);
+	std::vector<float> gradient(input_size);
+	Gradient(inputs.data(), gradient.data());
+	return gradient;
+}
+
+// The partials of 'Pow' are only applied to nonzero tangents. A constant exponent or base has none,
+// so x^2 at x < 0 does not pick up the NaN of log(x).
+float CompiledExp::Directional(const float* inputs, const float* direction, float* derivative)
+{
+	tangents.resize(instructions.size());
+	float* s = slots.data();
+	float* t = tangents.data();
+	for (std::size_t i = 0; i < instructions.size(); i++)
+	{
+		const Instruction& ins = instructions[i];
+		switch (ins.op)
+		{
+			case OpCode::Value: s[i] = constants[ins.l]; t[i] = 0; break;
+			case OpCode::Input: s[i] = inputs[ins.l]; t[i] = direction[ins.l]; break;
+			case OpCode::Neg: s[i] = -s[ins.l]; t[i] = -t[ins.l]; break;
+			case OpCode::Add: s[i] = s[ins.l] + s[ins.r]; t[i] = t[ins.l] + t[ins.r]; break;
+			case OpCode::Sub: s[i] = s[ins.l] - s[ins.r]; t[i] = t[ins.l] - t[ins.r]; break;
+			case OpCode::Mul: s[i] = s[ins.l] * s[ins.r]; t[i] = t[ins.l] * s[ins.r] + s[ins.l] * t[ins.r]; break;
+			case OpCode::Div: s[i] = s[ins.l] / s[ins.r]; t[i] = (t[ins.l] - s[i] * t[ins.r]) / s[ins.r]; break;
+			case OpCode::Pow:
+				s[i] = std::pow(s[ins.l], s[ins.r]);
+				t[i] = (t[ins.l] == 0 ? 0 : t[ins.l] * PowPartial(s[ins.l], s[ins.r]))
+					+ (t[ins.r] == 0 ? 0 : t[ins.r] * s[i] * std::log(s[ins.l]));
+				break;
+			case OpCode::Exp: s[i] = std::exp(s[ins.l]); t[i] = t[ins.l] * s[i]; break;
+			case OpCode::Log: s[i] = std::log(s[ins.l]); t[i] = t[ins.l] / s[ins.l]; break;
+		}
+	}
+	*derivative = tangents.back();
+	return slots.back();
+}
+
+// The values are computed once. Every instruction then scales the tangents of its operands by
+// scalar partials, loops over the lanes that the compiler vectorizes.
+float CompiledExp::Directional(const float* inputs, const float* directions, std::size_t n, float* derivatives)
+{
+	Forward(inputs);
+	block_tangents.resize(instructions.size() * lanes);
+	const float* s = slots.data();
+	float* b = block_tangents.data();
+	const std::size_t last = instructions.size() - 1;
+	for (std::size_t first = 0; first < n; first += lanes)
+	{
+		const std::size_t count = std::min(lanes, n - first);
+		for (std::size_t i = 0; i < instructions.size(); i++)
+		{
+			const Instruction& ins = instructions[i];
+			float* d = b + i * lanes;
+			const float* x = b + ins.l * lanes;
+			const float* y = b + ins.r * lanes;
+			switch (ins.op)
+			{
+				case OpCode::Value: std::fill_n(d, count, 0.0f); break;
+				case OpCode::Input: std::copy_n(directions + ins.l * n + first, count, d); break;
+				case OpCode::Neg: for (std::size_t k = 0; k < count; k++) d[k] = -x[k]; break;
+				case OpCode::Add: for (std::size_t k = 0; k < count; k++) d[k] = x[k] + y[k]; break;
+				case OpCode::Sub: for (std::size_t k = 0; k < count; k++) d[k] = x[k] - y[k]; break;
+				case OpCode::Mul:
+				{
+					const float l = s[ins.l], r = s[ins.r];
+					for (std::size_t k = 0; k < count; k++) d[k] = x[k] * r + l * y[k];
+					break;
+				}
+				case OpCode::Div:
+				{
+					const float q = s[i], r = s[ins.r];
+					for (std::size_t k = 0; k < count; k++) d[k] = (x[k] - q * y[k]) / r;
+					break;
+				}
+				case OpCode::Pow:
+				{
+					const float dl = PowPartial(s[ins.l], s[ins.r]), dr = s[i] * std::log(s[ins.l]);
+					for (std::size_t k = 0; k < count; k++)
+						d[k] = (x[k] == 0 ? 0 : x[k] * dl) + (y[k] == 0 ? 0 : y[k] * dr);
+					break;
+				}
+				case OpCode::Exp:
+				{
+					const float e = s[i];
+					for (std::size_t k = 0; k < count; k++) d[k] = x[k] * e;
+					break;
+				}
+				case OpCode::Log:
+				{
+					const float r = s[ins.l];
+					for (std::size_t k = 0; k < count; k++) d[k] = x[k] / r;
+					break;
+				}
+			}
+		}
+		std::copy_n(b + last * lanes, count, derivatives + first);
+	}
+	return slots.back();
+}
+
+void CompiledExp::ForwardBlock(const float* inputs, std::size_t stride, std::size_t count) noexcept
+{
+	float* b = block_slots.data();
+	for (std::size_t i = 0; i < instructions.size(); i++)
+	{
+		const Instruction& ins = instructions[i];
+		float* d = b + i * lanes;
+		const float* x = b + ins.l * lanes;
+		const float* y = b + ins.r * lanes;
+		switch (ins.op)
+		{
+			case OpCode::Value: std::fill_n(d, count, constants[ins.l]); break;
+			case OpCode::Input: std::copy_n(inputs + ins.l * stride, count, d); break;
+			case OpCode::Neg: for (std::size_t k = 0; k < count; k++) d[k] = -x[k]; break;
+			case OpCode::Add: for (std::size_t k = 0; k < count; k++) d[k] = x[k] + y[k]; break;
+			case OpCode::Sub: for (std::size_t k = 0; k < count; k++) d[k] = x[k] - y[k]; break;
+			case OpCode::Mul: for (std::size_t k = 0; k < count; k++) d[k] = x[k] * y[k]; break;
+			case OpCode::Div: for (std::size_t k = 0; k < count; k++) d[k] = x[k] / y[k]; break;
+			case OpCode::Pow: VecPow(x, y, d, count); break;
+			case OpCode::Exp: for (std::size_t k = 0; k < count; k++) d[k] = VecExp(x[k]); break;
+			case OpCode::Log: for (std::size_t k = 0; k < count; k++) d[k] = VecLog(x[k]); break;
+		}
+	}
+}
+
+void CompiledExp::Batch(const float* inputs, std::size_t n, float* out)
+{
+	block_slots.resize(instructions.size() * lanes);
+	const float* result = block_slots.data() + (instructions.size() - 1) * lanes;
+	for (std::size_t row = 0; row < n; row += lanes)
+	{
+		const std::size_t count = std::min(lanes, n - row);
+		ForwardBlock(inputs + row, n, count);
+		std::copy_n(result, count, out + row);
+	}
+}
+
+void CompiledExp::BatchGradient(const float* inputs, std::size_t n, float* out, float* gradient)
+{
+	block_slots.resize(instructions.size() * lanes);
+	block_adjoints.resize(instructions.size() * lanes);
+	const float* b = block_slots.data();
+	float* a = block_adjoints.data();
+	const std::size_t last = instructions.size() - 1;
+	for (std::size_t row = 0; row < n; row += lanes)
+	{
+		const std::size_t count = std::min(lanes, n - row);
+		ForwardBlock(inputs + row, n, count);
+		std::copy_n(b + last * lanes, count, out + row);
+
+		for (std::size_t j = 0; j < input_size; j++)
+			std::fill_n(gradient + j * n + row, count, 0.0f);
+		std::fill(block_adjoints.begin(), block_adjoints.end(), 0.0f);
+		std::fill_n(a + last * lanes, count, 1.0f);
+		for (std::size_t i = instructions.size(); i-- > 0;)
+		{
+			const Instruction& ins = instructions[i];
+			const float* d = b + i * lanes;
+			const float* x = b + ins.l * lanes;
+			const float* y = b + ins.r * lanes;
+			const float* ad = a + i * lanes;
+			float* ax = a + ins.l * lanes;
+			float* ay = a + ins.r * lanes;
+			switch (ins.op)
+			{
+				case OpCode::Value: break;
+				case OpCode::Input:
+				{
+					float* g = gradient + ins.l * n + row;
+					for (std::size_t k = 0; k < count; k++) g[k] += ad[k];
+					break;
+				}
+				case OpCode::Neg: for (std::size_t k = 0; k < count; k++) ax[k] -= ad[k]; break;
+				case OpCode::Add: for (std::size_t k = 0; k < count; k++) { ax[k] += ad[k]; ay[k] += ad[k]; } break;
+				case OpCode::Sub: for (std::size_t k = 0; k < count; k++) { ax[k] += ad[k]; ay[k] -= ad[k]; } break;
+				case OpCode::Mul: for (std::size_t k = 0; k < count; k++) { ax[k] += ad[k] * y[k]; ay[k] += ad[k] * x[k]; } break;
+				case OpCode::Div: for (std::size_t k = 0; k < count; k++) { ax[k] += ad[k] / y[k]; ay[k] -= ad[k] * d[k] / y[k]; } break;
+				case OpCode::Pow:
+				{
+					float e[lanes], t[lanes];
+					for (std::size_t k = 0; k < count; k++) e[k] = y[k] - 1;
+					VecPow(x, e, t, count);
+					// As PowPartial, zero for y = 0 even where pow(x, -1) is infinite.
+					for (std::size_t k = 0; k < count; k++) ax[k] += y[k] == 0 ? 0.0f : ad[k] * y[k] * t[k];
+					for (std::size_t k = 0; k < count; k++) t[k] = VecLog(x[k]);
+					for (std::size_t k = 0; k < count; k++) ay[k] += ad[k] * d[k] * t[k];
+					break;
+				}
+				case OpCode::Exp: for (std::size_t k = 0; k < count; k++) ax[k] += ad[k] * d[k]; break;
+				case OpCode::Log: for (std::size_t k = 0; k < count; k++) ax[k] += ad[k] / x[k]; break;
+			}
+		}
+	}
+}
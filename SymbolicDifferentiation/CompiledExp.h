@@ -0,0 +1,215 @@
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+// Forward declaration
+namespace AST
+{
+	class Node;
+	class Symbol;
+}
+
+enum class OpCode : std::uint8_t
+{
+	Value, Input, Neg, Add, Sub, Mul, Div, Pow, Exp, Log
+};
+
+// One step of a postorder tape.
+// The result of instruction i is stored in slot i.
+// 'l' and 'r' are slot indices of the operands. For 'Value' 'l' indexes the constant pool, for 'Input' it indexes the inputs.
+struct Instruction
+{
+	OpCode op;
+	std::uint32_t l = 0, r = 0;
+};
+
+// Partial derivative of pow(x, y) with respect to 'x', zero for y = 0 even where pow(x, -1) is infinite.
+// Shared by every evaluator, so forward and reverse mode agree.
+template <typename Scalar>
+[[nodiscard]] Scalar PowPartial(Scalar x, Scalar y)
+{
+	using std::pow;
+	return y == Scalar(0) ? Scalar(0) : y * pow(x, y - Scalar(1));
+}
+
+// Builder that AST::Node::Compile lowers into.
+class Tape
+{
+	friend class CompiledExp;
+	friend class CodeGen;
+	friend class SparseJacobian;
+	friend class IncrementalExp;
+	template <typename Scalar> friend class Evaluator;
+	std::vector<Instruction> instructions;
+	std::vector<float> constants;
+	std::unordered_map<std::uint32_t, std::uint32_t> inputs; // symbol ID -> input index
+	std::unordered_map<const AST::Node*, std::uint32_t> compiled; // node -> slot
+public:
+	Tape(const std::vector<const AST::Symbol*>& inputs);
+
+	// Lowers 'node' once, shared nodes reuse their slot.
+	std::uint32_t Compile(const AST::Node&);
+
+	std::uint32_t Emit(OpCode, std::uint32_t l = 0, std::uint32_t r = 0);
+	std::uint32_t Value(float);
+	std::uint32_t Input(const AST::Symbol&);
+};
+
+// Reusable evaluator of a SymExp.
+// Evaluating performs no allocation and no virtual calls.
+// The tape is immutable and shared by copies, it lives on the heap or in a file mapped by MappedExp.
+class CompiledExp
+{
+	friend class MappedExp;
+	std::shared_ptr<const void> storage; // owner of the tape
+	std::span<const Instruction> instructions;
+	std::span<const float> constants;
+	std::vector<float> slots, adjoints;
+	std::vector<float> tangents; // sized on first use
+	std::vector<float> block_slots, block_adjoints, block_tangents; // 'lanes' values per instruction, sized on first use
+	std::size_t input_size;
+
+	CompiledExp(std::shared_ptr<const void> storage, std::span<const Instruction>, std::span<const float> constants, std::size_t input_size);
+
+	void Forward(const float* inputs) noexcept;
+	void ForwardBlock(const float* inputs, std::size_t stride, std::size_t count) noexcept;
+public:
+	// Rows evaluated together by the batch functions.
+	static constexpr std::size_t lanes = 64;
+
+	CompiledExp(Tape&&) noexcept;
+
+	[[nodiscard]] std::size_t size() const noexcept { return instructions.size(); }
+	[[nodiscard]] std::size_t inputs() const noexcept { return input_size; }
+
+	// 'inputs' holds one value per Var passed to SymExp::Compile, in the same order.
+	float operator()(const float* inputs) noexcept;
+	float operator()(const std::vector<float>& inputs) noexcept;
+
+	// Reverse mode: writes one partial derivative per input into 'gradient' and returns the value.
+	float Gradient(const float* inputs, float* gradient) noexcept;
+	[[nodiscard]] std::vector<float> Gradient(const std::vector<float>& inputs);
+
+	// Forward mode: writes the derivative along 'direction', one component per input, into 'derivative' and returns the value.
+	float Directional(const float* inputs, const float* direction, float* derivative);
+
+	// Forward mode along 'n' directions in one sweep: component j of direction d is 'directions[j * n + d]',
+	// the derivative along d is written to 'derivatives[d]'. Returns the value.
+	// The tangents of up to 'lanes' directions are propagated together.
+	float Directional(const float* inputs, const float* directions, std::size_t n, float* derivatives);
+
+	// Evaluates 'n' rows given in structure-of-arrays layout: input j of row i is 'inputs[j * n + i]'.
+	// Transcendentals use branch-free approximations accurate to a few ulp, which the compiler vectorizes.
+	void Batch(const float* inputs, std::size_t n, float* out);
+
+	// As 'Batch', additionally writing partial derivative j of row i to 'gradient[j * n + i]'.
+	void BatchGradient(const float* inputs, std::size_t n, float* out, float* gradient);
+};
+
+// Reusable evaluator of a SymExp at the precision of 'Scalar', see SymExp::Compile<Scalar>.
+// The tree is built once in float. Constants are converted on construction, and the arithmetic,
+// the inputs and the derivatives are all in 'Scalar'. 'pow', 'exp' and 'log' are found by
+// argument-dependent lookup, so user-defined scalar types can supply their own.
+template <typename Scalar>
+class Evaluator
+{
+	std::vector<Instruction> instructions;
+	std::vector<Scalar> constants;
+	std::vector<Scalar> slots, adjoints;
+	std::size_t input_size;
+
+	void Forward(const Scalar* inputs) noexcept
+	{
+		using std::pow, std::exp, std::log;
+		Scalar* s = slots.data();
+		for (std::size_t i = 0; i < instructions.size(); i++)
+		{
+			const Instruction& ins = instructions[i];
+			switch (ins.op)
+			{
+				case OpCode::Value: s[i] = constants[ins.l]; break;
+				case OpCode::Input: s[i] = inputs[ins.l]; break;
+				case OpCode::Neg: s[i] = -s[ins.l]; break;
+				case OpCode::Add: s[i] = s[ins.l] + s[ins.r]; break;
+				case OpCode::Sub: s[i] = s[ins.l] - s[ins.r]; break;
+				case OpCode::Mul: s[i] = s[ins.l] * s[ins.r]; break;
+				case OpCode::Div: s[i] = s[ins.l] / s[ins.r]; break;
+				case OpCode::Pow: s[i] = pow(s[ins.l], s[ins.r]); break;
+				case OpCode::Exp: s[i] = exp(s[ins.l]); break;
+				case OpCode::Log: s[i] = log(s[ins.l]); break;
+			}
+		}
+	}
+public:
+	Evaluator(Tape&& tape)
+		: instructions(std::move(tape.instructions))
+		, constants(tape.constants.begin(), tape.constants.end())
+		, slots(instructions.size())
+		, adjoints(instructions.size())
+		, input_size(tape.inputs.size())
+	{}
+
+	[[nodiscard]] std::size_t size() const noexcept { return instructions.size(); }
+	[[nodiscard]] std::size_t inputs() const noexcept { return input_size; }
+
+	// 'inputs' holds one value per Var passed to SymExp::Compile, in the same order.
+	Scalar operator()(const Scalar* inputs) noexcept
+	{
+		Forward(inputs);
+		return slots.back();
+	}
+
+	Scalar operator()(const std::vector<Scalar>& inputs) noexcept
+	{
+		assert(inputs.size() == input_size);
+		return operator()(inputs.data());
+	}
+
+	// Reverse mode: writes one partial derivative per input into 'gradient' and returns the value.
+	Scalar Gradient(const Scalar* inputs, Scalar* gradient) noexcept
+	{
+		using std::log;
+		Forward(inputs);
+
+		const Scalar* s = slots.data();
+		Scalar* a = adjoints.data();
+		std::fill(adjoints.begin(), adjoints.end(), Scalar(0));
+		std::fill(gradient, gradient + input_size, Scalar(0));
+		adjoints.back() = Scalar(1);
+		for (std::size_t i = instructions.size(); i-- > 0;)
+		{
+			const Instruction& ins = instructions[i];
+			switch (ins.op)
+			{
+				case OpCode::Value: break;
+				case OpCode::Input: gradient[ins.l] += a[i]; break;
+				case OpCode::Neg: a[ins.l] -= a[i]; break;
+				case OpCode::Add: a[ins.l] += a[i]; a[ins.r] += a[i]; break;
+				case OpCode::Sub: a[ins.l] += a[i]; a[ins.r] -= a[i]; break;
+				case OpCode::Mul: a[ins.l] += a[i] * s[ins.r]; a[ins.r] += a[i] * s[ins.l]; break;
+				case OpCode::Div: a[ins.l] += a[i] / s[ins.r]; a[ins.r] -= a[i] * s[i] / s[ins.r]; break;
+				case OpCode::Pow:
+					a[ins.l] += a[i] * PowPartial(s[ins.l], s[ins.r]);
+					a[ins.r] += a[i] * s[i] * log(s[ins.l]);
+					break;
+				case OpCode::Exp: a[ins.l] += a[i] * s[i]; break;
+				case OpCode::Log: a[ins.l] += a[i] / s[ins.l]; break;
+			}
+		}
+		return slots.back();
+	}
+
+	[[nodiscard]] std::vector<Scalar> Gradient(const std::vector<Scalar>& inputs)
+	{
+		assert(inputs.size() == input_size);
+		std::vector<Scalar> gradient(input_size);
+		Gradient(inputs.data(), gradient.data());
+		return gradient;
+	}
+};
@@ -0,0 +1,93 @@
+#include "DerivativeCache.h"
+#include <cassert>
+
+using namespace AST;
+
+Derivatives& DerivativeCache::Of(const Var& var)
+{
+	const auto& symbol = static_cast<const Symbol&>(*var.root);
+	auto it = entries.find(symbol.id());
+	if (it == entries.end())
+		it = entries.emplace(symbol.id(), Entry{ var, Derivatives(symbol) }).first;
+	return it->second.derivatives;
+}
+
+NodePtr DerivativeCache::Root(const SymExp& exp)
+{
+	if (count >= capacity)
+		Clear();
+	auto [it, inserted] = roots.try_emplace(exp.root);
+	if (inserted)
+	{
+		it->second = exp.root->Simplify();
+		count++;
+	}
+	return it->second;
+}
+
+SymExp DerivativeCache::Derive(const SymExp& exp, const Var& var)
+{
+	const NodePtr root = Root(exp);
+	Derivatives& derivatives = Of(var);
+	const std::size_t before = derivatives.size();
+	NodePtr ret = derivatives.Derive(*root);
+	count += derivatives.size() - before;
+	return SymExp{ std::move(ret) };
+}
+
+SymExpVec DerivativeCache::Derive(const SymExp& exp, const std::vector<Var>& vars)
+{
+	const NodePtr root = Root(exp);
+	const NodePtr zero = Make<Value>(0);
+	std::vector<SymExp> ret;
+	ret.reserve(vars.size());
+	std::vector<std::size_t> missing;
+	for (std::size_t i = 0; i < vars.size(); i++)
+	{
+		const auto& symbol = static_cast<const Symbol&>(*vars[i].root);
+		NodePtr derivative = root->mentions(symbol) ? Of(vars[i]).Find(*root) : zero;
+		if (not derivative)
+			missing.push_back(i);
+		ret.push_back(SymExp{ derivative ? std::move(derivative) : root });
+	}
+	if (missing.empty())
+		return ret;
+
+	// The missing derivatives of the root, all from one sweep.
+	std::vector<Var> sweep;
+	sweep.reserve(missing.size());
+	for (auto i : missing)
+		sweep.push_back(vars[i]);
+	auto gradient = SymExp{ root }.Gradient(sweep);
+	auto it = gradient.begin();
+	for (auto i : missing)
+	{
+		Of(vars[i]).Insert(*root, it->root);
+		ret[i] = *it++;
+	}
+	count += missing.size();
+	return ret;
+}
+
+SymExpVec DerivativeCache::DeriveAt(const SymExp& exp, const std::vector<Var>& vars, const std::vector<float>& values)
+{
+	assert(vars.size() == values.size());
+	return Derive(exp, vars).At(vars, values);
+}
+
+std::vector<SymExpVec> DerivativeCache::Derive(const SymExpVec& exps, const std::vector<Var>& vars)
+{
+	std::vector<SymExpVec> ret;
+	ret.reserve(exps.size());
+	for (const auto& exp : exps)
+		ret.push_back(Derive(exp, vars));
+	return ret;
+}
+
+void DerivativeCache::Clear() noexcept
+{
+	// The derivatives go first, they are keyed by the nodes held in 'roots'.
+	entries.clear();
+	roots.clear();
+	count = 0;
+}
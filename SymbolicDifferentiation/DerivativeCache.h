@@ -0,0 +1,46 @@
+#pragma once
+#include "SymExp.h"
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Derivatives kept across calls, one per distinct (node, variable) pair.
+// Nodes are interned, so a subtree shared between expressions, or derived again later, is derived once per variable.
+// Every expression derived is held along with its simplified form, so no entry outlives its node. Held expressions count as entries,
+// and once 'capacity' entries are reached the next call starts over from an empty cache. Not thread-safe.
+class DerivativeCache
+{
+	struct Entry
+	{
+		Var var;
+		AST::Derivatives derivatives;
+	};
+
+	std::unordered_map<std::uint32_t, Entry> entries; // by symbol ID
+	std::unordered_map<AST::NodePtr, AST::NodePtr> roots; // expression -> simplified expression
+	std::size_t capacity;
+	std::size_t count = 0;
+
+	[[nodiscard]] AST::Derivatives& Of(const Var&);
+	[[nodiscard]] AST::NodePtr Root(const SymExp&);
+public:
+	static constexpr std::size_t default_capacity = std::size_t{ 1 } << 20;
+
+	explicit DerivativeCache(std::size_t capacity = default_capacity) noexcept : capacity(capacity) {}
+
+	// As 'SymExp::Derive', with every derived subtree cached.
+	[[nodiscard]] SymExp Derive(const SymExp&, const Var&);
+
+	// Gradient. Derivatives not cached yet come from one reverse sweep, see 'SymExp::Gradient'.
+	[[nodiscard]] SymExpVec Derive(const SymExp&, const std::vector<Var>&);
+	[[nodiscard]] SymExpVec DeriveAt(const SymExp&, const std::vector<Var>&, const std::vector<float>& values);
+
+	// Jacobian, one row per element. The Hessian is the Jacobian of the gradient.
+	[[nodiscard]] std::vector<SymExpVec> Derive(const SymExpVec&, const std::vector<Var>&);
+
+	// Number of cached derivatives and held expressions.
+	[[nodiscard]] std::size_t size() const noexcept { return count; }
+
+	void Clear() noexcept;
+};
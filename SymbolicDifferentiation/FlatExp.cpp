@@ -0,0 +1,410 @@
+#include "FlatExp.h"
+#include <bit>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+
+namespace
+{
+	constexpr std::uint32_t none = UINT32_MAX;
+
+	[[nodiscard]] constexpr std::size_t Arity(OpCode op) noexcept
+	{
+		switch (op)
+		{
+			case OpCode::Value:
+			case OpCode::Input: return 0;
+			case OpCode::Neg:
+			case OpCode::Exp:
+			case OpCode::Log: return 1;
+			default: return 2;
+		}
+	}
+}
+
+// Appends nodes, each structurally distinct one once, applying the simplification rules of the node store
+// that need no more than the two operands. Derivatives built through it come out folded.
+class FlatExp::Builder
+{
+	struct Hash
+	{
+		[[nodiscard]] std::size_t operator()(const Node& n) const noexcept
+		{
+			return AST::HashCombine(AST::HashCombine(static_cast<std::size_t>(n.op), n.l), n.r);
+		}
+	};
+
+	std::vector<Node> nodes;
+	std::unordered_map<Node, std::uint32_t, Hash> index;
+
+	std::uint32_t Intern(const Node& n)
+	{
+		auto [it, inserted] = index.try_emplace(n, static_cast<std::uint32_t>(nodes.size()));
+		if (inserted)
+			nodes.push_back(n);
+		return it->second;
+	}
+
+	[[nodiscard]] bool Is(std::uint32_t i, float v) const noexcept { return has_value(i) and value(i) == v; }
+
+	// Result of a rule that applies to 'op' over 'l' and 'r', 'none' when none does.
+	std::uint32_t Fold(OpCode op, std::uint32_t l, std::uint32_t r)
+	{
+		switch (op)
+		{
+			case OpCode::Neg:
+				if (has_value(l))
+					return Value(-value(l));
+				if (nodes[l].op == OpCode::Neg)
+					return nodes[l].l;
+				break;
+			case OpCode::Add:
+				if (has_value(l) and has_value(r))
+					return Value(value(l) + value(r));
+				if (Is(l, 0))
+					return r;
+				if (Is(r, 0))
+					return l;
+				break;
+			case OpCode::Sub:
+				if (has_value(l) and has_value(r))
+					return Value(value(l) - value(r));
+				if (Is(l, 0))
+					return Make(OpCode::Neg, r);
+				if (Is(r, 0))
+					return l;
+				if (l == r)
+					return Value(0);
+				break;
+			case OpCode::Mul:
+				if (has_value(l) and has_value(r))
+					return Value(value(l) * value(r));
+				if (Is(l, 0) or Is(r, 0))
+					return Value(0);
+				if (Is(l, 1))
+					return r;
+				if (Is(r, 1))
+					return l;
+				if (Is(l, -1))
+					return Make(OpCode::Neg, r);
+				if (Is(r, -1))
+					return Make(OpCode::Neg, l);
+				break;
+			case OpCode::Div:
+				if (has_value(l) and has_value(r))
+					return Value(value(l) / value(r));
+				if (Is(l, 0))
+					return Value(0);
+				if (Is(r, 0))
+					return Value(std::numeric_limits<float>::infinity());
+				if (Is(r, 1))
+					return l;
+				if (l == r)
+					return Value(1);
+				break;
+			case OpCode::Pow:
+				if (has_value(l) and has_value(r))
+					return Value(std::pow(value(l), value(r)));
+				if (Is(l, 0))
+					return Value(0);
+				if (Is(l, 1) or Is(r, 0))
+					return Value(1);
+				if (Is(r, 1))
+					return l;
+				break;
+			case OpCode::Exp:
+				if (has_value(l))
+					return Value(std::exp(value(l)));
+				if (nodes[l].op == OpCode::Log)
+					return nodes[l].l;
+				break;
+			case OpCode::Log:
+				if (has_value(l))
+					return Value(std::log(value(l)));
+				if (nodes[l].op == OpCode::Exp)
+					return nodes[l].l;
+				break;
+			default:
+				break;
+		}
+		return none;
+	}
+public:
+	Builder() = default;
+	explicit Builder(std::size_t capacity)
+	{
+		nodes.reserve(capacity);
+		index.reserve(capacity);
+	}
+
+	[[nodiscard]] bool has_value(std::uint32_t i) const noexcept { return nodes[i].op == OpCode::Value; }
+	[[nodiscard]] float value(std::uint32_t i) const noexcept { return std::bit_cast<float>(nodes[i].l); }
+
+	std::uint32_t Value(float v) { return Intern({ OpCode::Value, std::bit_cast<std::uint32_t>(v) }); }
+	std::uint32_t Symbol(std::uint32_t id) { return Intern({ OpCode::Input, id }); }
+
+	// Smart constructor, see AST::MakeSimplified. Commutative operands are ordered by index.
+	std::uint32_t Make(OpCode op, std::uint32_t l, std::uint32_t r = 0)
+	{
+		if (const std::uint32_t folded = Fold(op, l, r); folded != none)
+		{
+			Stats::FlatFolded(op);
+			return folded;
+		}
+		if ((op == OpCode::Add or op == OpCode::Mul) and r < l)
+			std::swap(l, r);
+		return Intern({ op, l, r });
+	}
+
+	// The nodes 'root' reaches, in their order. Operands precede their users,
+	// so one backward loop marks them and one forward loop renumbers them.
+	[[nodiscard]] FlatExp Finish(std::uint32_t root) &&
+	{
+		std::vector<std::uint32_t> remap(root + 1, none);
+		remap[root] = 0;
+		for (std::size_t i = root + 1; i-- > 0;)
+		{
+			if (remap[i] == none)
+				continue;
+			const std::size_t arity = Arity(nodes[i].op);
+			if (arity >= 1)
+				remap[nodes[i].l] = 0;
+			if (arity == 2)
+				remap[nodes[i].r] = 0;
+		}
+
+		std::vector<Node> ret;
+		for (std::size_t i = 0; i <= root; i++)
+		{
+			if (remap[i] == none)
+				continue;
+			Node n = nodes[i];
+			const std::size_t arity = Arity(n.op);
+			if (arity >= 1)
+				n.l = remap[n.l];
+			if (arity == 2)
+				n.r = remap[n.r];
+			remap[i] = static_cast<std::uint32_t>(ret.size());
+			ret.push_back(n);
+		}
+		return FlatExp{ std::move(ret) };
+	}
+};
+
+std::uint32_t FlatExp::Id(const Var& var) noexcept
+{
+	return static_cast<const AST::Symbol&>(*var.root).id();
+}
+
+FlatExp::FlatExp(const SymExp& exp)
+{
+	Builder b;
+	std::unordered_map<const AST::Node*, std::uint32_t> slots;
+	for (const AST::Node* node : AST::Postorder(*exp.root))
+	{
+		auto operand = [&](std::size_t i) { return slots.at(node->operand(i).get()); };
+		std::uint32_t slot;
+		switch (node->op())
+		{
+			case OpCode::Value: slot = b.Value(node->value()); break;
+			case OpCode::Input: slot = b.Symbol(static_cast<const AST::Symbol*>(node)->id()); break;
+			case OpCode::Add:
+			case OpCode::Mul:
+				// n-ary, as a chain of binary nodes
+				slot = operand(0);
+				for (std::size_t i = 1; i < node->arity(); i++)
+					slot = b.Make(node->op(), slot, operand(i));
+				break;
+			default: slot = b.Make(node->op(), operand(0), node->arity() == 2 ? operand(1) : 0); break;
+		}
+		slots.emplace(node, slot);
+	}
+	*this = std::move(b).Finish(slots.at(exp.root.get()));
+}
+
+SymExp FlatExp::ToSymExp() const
+{
+	using namespace AST;
+	std::vector<NodePtr> built;
+	built.reserve(nodes.size());
+	for (const Node& n : nodes)
+	{
+		switch (n.op)
+		{
+			case OpCode::Value: built.push_back(Make<AST::Value>(std::bit_cast<float>(n.l))); break;
+			case OpCode::Input: built.push_back(SymbolNode(n.l)); break;
+			case OpCode::Neg: built.push_back(Make<Neg>(built[n.l])); break;
+			case OpCode::Add: built.push_back(Make<Add>(built[n.l], built[n.r])); break;
+			case OpCode::Sub: built.push_back(Make<Sub>(built[n.l], built[n.r])); break;
+			case OpCode::Mul: built.push_back(Make<Mul>(built[n.l], built[n.r])); break;
+			case OpCode::Div: built.push_back(Make<Div>(built[n.l], built[n.r])); break;
+			case OpCode::Pow: built.push_back(Make<Pow>(built[n.l], built[n.r])); break;
+			case OpCode::Exp: built.push_back(Make<Exp>(built[n.l])); break;
+			case OpCode::Log: built.push_back(Make<Log>(built[n.l])); break;
+		}
+	}
+	return SymExp{ std::move(built.back()) };
+}
+
+FlatExp FlatExp::Rebuild(const std::vector<Var>& vars, const std::vector<float>& values) const
+{
+	assert(vars.size() == values.size());
+	std::unordered_map<std::uint32_t, float> bound; // symbol ID -> value, the first binding wins
+	for (std::size_t i = 0; i < vars.size(); i++)
+		bound.try_emplace(Id(vars[i]), values[i]);
+
+	Builder b(nodes.size());
+	std::vector<std::uint32_t> slots(nodes.size());
+	for (std::size_t i = 0; i < nodes.size(); i++)
+	{
+		const Node& n = nodes[i];
+		switch (n.op)
+		{
+			case OpCode::Value: slots[i] = b.Value(std::bit_cast<float>(n.l)); break;
+			case OpCode::Input:
+			{
+				auto it = bound.find(n.l);
+				slots[i] = it == bound.end() ? b.Symbol(n.l) : b.Value(it->second);
+				break;
+			}
+			case OpCode::Neg:
+			case OpCode::Exp:
+			case OpCode::Log: slots[i] = b.Make(n.op, slots[n.l]); break;
+			default: slots[i] = b.Make(n.op, slots[n.l], slots[n.r]); break;
+		}
+	}
+	return std::move(b).Finish(slots.back());
+}
+
+FlatExp FlatExp::At(const Var& var, float value) const
+{
+	return Rebuild({ var }, { value });
+}
+
+FlatExp FlatExp::At(const std::vector<Var>& vars, const std::vector<float>& values) const
+{
+	return Rebuild(vars, values);
+}
+
+FlatExp FlatExp::Simplify() const
+{
+	return Rebuild({}, {});
+}
+
+// One forward loop copies each node and builds its derivative from those of its operands.
+FlatExp FlatExp::Derive(const Var& var) const
+{
+	const std::uint32_t id = Id(var);
+	Builder b(4 * nodes.size()); // a node and about three for its derivative
+	const std::uint32_t zero = b.Value(0), one = b.Value(1);
+	std::vector<std::uint32_t> same(nodes.size()), derived(nodes.size());
+	for (std::size_t i = 0; i < nodes.size(); i++)
+	{
+		const Node& n = nodes[i];
+		const std::size_t arity = Arity(n.op);
+		const std::uint32_t L = arity >= 1 ? same[n.l] : 0, dL = arity >= 1 ? derived[n.l] : 0;
+		const std::uint32_t R = arity == 2 ? same[n.r] : 0, dR = arity == 2 ? derived[n.r] : 0;
+		switch (n.op)
+		{
+			case OpCode::Value:
+				same[i] = b.Value(std::bit_cast<float>(n.l));
+				derived[i] = zero;
+				break;
+			case OpCode::Input:
+				same[i] = b.Symbol(n.l);
+				derived[i] = n.l == id ? one : zero;
+				break;
+			case OpCode::Neg:
+				same[i] = b.Make(OpCode::Neg, L);
+				derived[i] = b.Make(OpCode::Neg, dL);
+				break;
+			case OpCode::Add:
+			case OpCode::Sub:
+				same[i] = b.Make(n.op, L, R);
+				derived[i] = b.Make(n.op, dL, dR);
+				break;
+			case OpCode::Mul:
+				same[i] = b.Make(OpCode::Mul, L, R);
+				derived[i] = b.Make(OpCode::Add, b.Make(OpCode::Mul, dL, R), b.Make(OpCode::Mul, L, dR));
+				break;
+			case OpCode::Div:
+				same[i] = b.Make(OpCode::Div, L, R);
+				derived[i] = b.Make(OpCode::Div,
+					b.Make(OpCode::Sub, b.Make(OpCode::Mul, dL, R), b.Make(OpCode::Mul, L, dR)),
+					b.Make(OpCode::Mul, R, R));
+				break;
+			case OpCode::Pow:
+				same[i] = b.Make(OpCode::Pow, L, R);
+				if (b.has_value(R))
+					derived[i] = b.Make(OpCode::Mul, b.Make(OpCode::Mul, R, b.Make(OpCode::Pow, L, b.Value(b.value(R) - 1))), dL);
+				else
+					derived[i] = b.Make(OpCode::Mul, same[i], b.Make(OpCode::Add,
+						b.Make(OpCode::Mul, dR, b.Make(OpCode::Log, L)),
+						b.Make(OpCode::Mul, R, b.Make(OpCode::Div, dL, L))));
+				break;
+			case OpCode::Exp:
+				same[i] = b.Make(OpCode::Exp, L);
+				derived[i] = b.Make(OpCode::Mul, same[i], dL);
+				break;
+			case OpCode::Log:
+				same[i] = b.Make(OpCode::Log, L);
+				derived[i] = b.Make(OpCode::Div, dL, L);
+				break;
+		}
+	}
+	return std::move(b).Finish(derived.back());
+}
+
+float FlatExp::Eval(const std::vector<Var>& vars, const std::vector<float>& values) const
+{
+	assert(vars.size() == values.size());
+	std::unordered_map<std::uint32_t, float> bound;
+	for (std::size_t i = 0; i < vars.size(); i++)
+		bound.try_emplace(Id(vars[i]), values[i]);
+
+	std::vector<float> s(nodes.size());
+	for (std::size_t i = 0; i < nodes.size(); i++)
+	{
+		const Node& n = nodes[i];
+		switch (n.op)
+		{
+			case OpCode::Value: s[i] = std::bit_cast<float>(n.l); break;
+			case OpCode::Input:
+			{
+				auto it = bound.find(n.l);
+				if (it == bound.end())
+					throw std::invalid_argument("Unbound symbol '" + AST::SymbolName(n.l) + "' in FlatExp::Eval.");
+				s[i] = it->second;
+				break;
+			}
+			case OpCode::Neg: s[i] = -s[n.l]; break;
+			case OpCode::Add: s[i] = s[n.l] + s[n.r]; break;
+			case OpCode::Sub: s[i] = s[n.l] - s[n.r]; break;
+			case OpCode::Mul: s[i] = s[n.l] * s[n.r]; break;
+			case OpCode::Div: s[i] = s[n.l] / s[n.r]; break;
+			case OpCode::Pow: s[i] = std::pow(s[n.l], s[n.r]); break;
+			case OpCode::Exp: s[i] = std::exp(s[n.l]); break;
+			case OpCode::Log: s[i] = std::log(s[n.l]); break;
+		}
+	}
+	return s.back();
+}
+
+std::string FlatExp::to_string() const
+{
+	return ToSymExp().to_string();
+}
+
+bool FlatExp::has_value() const noexcept
+{
+	return nodes.back().op == OpCode::Value;
+}
+
+float FlatExp::value() const noexcept
+{
+	assert(has_value());
+	return std::bit_cast<float>(nodes.back().l);
+}
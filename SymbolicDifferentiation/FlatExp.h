@@ -0,0 +1,59 @@
+#pragma once
+#include "SymExp.h"
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+
+// Expression stored as one array of 12-byte tagged nodes, operands referenced by 32-bit index.
+// Operands come before their users and the root is last, so every pass is a single loop over
+// the array that switches on the tag, without virtual calls, reference counts or pointer chasing.
+// Results are built through folding constructors and hash-consed within the array, and only the
+// nodes the root reaches are kept. Sums and products are binary, with their operands in index order.
+// A FlatExp is a plain value, independent of the node store, and can be used from one thread per copy.
+class FlatExp
+{
+public:
+	// 'Value' keeps the bits of its float in 'l', 'Input' the symbol ID. Otherwise 'l' and 'r' index operands.
+	struct Node
+	{
+		OpCode op;
+		std::uint32_t l = 0, r = 0;
+
+		[[nodiscard]] friend bool operator==(const Node&, const Node&) noexcept = default;
+	};
+	static_assert(sizeof(Node) == 12);
+private:
+	class Builder;
+	std::vector<Node> nodes;
+
+	explicit FlatExp(std::vector<Node> nodes) noexcept : nodes(std::move(nodes)) {}
+
+	[[nodiscard]] static std::uint32_t Id(const Var&) noexcept;
+
+	// Copies the nodes the root reaches into a new array, folding constants and replacing
+	// the symbols in 'vars' by 'values'.
+	[[nodiscard]] FlatExp Rebuild(const std::vector<Var>& vars, const std::vector<float>& values) const;
+public:
+	explicit FlatExp(const SymExp&);
+
+	// The expression as nodes of the node store, unsimplified.
+	[[nodiscard]] SymExp ToSymExp() const;
+
+	[[nodiscard]] FlatExp At(const Var&, float value) const;
+	[[nodiscard]] FlatExp At(const std::vector<Var>&, const std::vector<float>& values) const;
+	[[nodiscard]] FlatExp Derive(const Var&) const;
+	[[nodiscard]] FlatExp Simplify() const;
+
+	// Value with every symbol bound. Throws std::invalid_argument for an unbound symbol.
+	[[nodiscard]] float Eval(const std::vector<Var>&, const std::vector<float>& values) const;
+
+	[[nodiscard]] std::string to_string() const;
+
+	[[nodiscard]] bool has_value() const noexcept;
+	[[nodiscard]] float value() const noexcept;
+
+	[[nodiscard]] std::size_t size() const noexcept { return nodes.size(); }
+	[[nodiscard]] std::span<const Node> data() const noexcept { return nodes; }
+};
@@ -0,0 +1,279 @@
+#include "Incremental.h"
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cmath>
+#include <functional>
+
+namespace
+{
+	// Bitwise, so that a NaN that stays NaN counts as unchanged and a zero changing sign does not.
+	[[nodiscard]] bool Same(float l, float r) noexcept
+	{
+		return std::bit_cast<std::uint32_t>(l) == std::bit_cast<std::uint32_t>(r);
+	}
+
+	[[nodiscard]] bool Binary(OpCode op) noexcept
+	{
+		return op != OpCode::Value and op != OpCode::Input and op != OpCode::Neg and op != OpCode::Exp and op != OpCode::Log;
+	}
+
+	// Partial derivatives that are constants, whatever the values.
+	[[nodiscard]] bool Linear(OpCode op) noexcept
+	{
+		return op == OpCode::Neg or op == OpCode::Add or op == OpCode::Sub;
+	}
+}
+
+IncrementalExp::IncrementalExp(const SymExp& exp, const std::vector<Var>& vars)
+{
+	Tape tape = SymExp::Lower(vars);
+	tape.Compile(*exp.root);
+	instructions = std::move(tape.instructions);
+	constants = std::move(tape.constants);
+	const std::size_t n = instructions.size();
+	slots.resize(n);
+	adjoints.resize(n);
+	queued.resize(n);
+	stale.resize(n);
+	values.resize(vars.size());
+	gradient.resize(vars.size());
+	input_slots.assign(vars.size(), none);
+
+	// Users of each slot, once even when they read it twice, ascending.
+	user_offsets.assign(n + 1, 0);
+	for (std::uint32_t i = 0; i < n; i++)
+	{
+		const Instruction& ins = instructions[i];
+		if (ins.op == OpCode::Input)
+			input_slots[ins.l] = i;
+		if (ins.op == OpCode::Value or ins.op == OpCode::Input)
+			continue;
+		user_offsets[ins.l + 1]++;
+		if (Binary(ins.op) and ins.r != ins.l)
+			user_offsets[ins.r + 1]++;
+	}
+	for (std::size_t j = 0; j < n; j++)
+		user_offsets[j + 1] += user_offsets[j];
+	users.resize(user_offsets[n]);
+	auto next = user_offsets;
+	for (std::uint32_t i = 0; i < n; i++)
+	{
+		const Instruction& ins = instructions[i];
+		if (ins.op == OpCode::Value or ins.op == OpCode::Input)
+			continue;
+		users[next[ins.l]++] = i;
+		if (Binary(ins.op) and ins.r != ins.l)
+			users[next[ins.r]++] = i;
+	}
+}
+
+void IncrementalExp::Push(std::uint32_t i) noexcept
+{
+	if (queued[i])
+		return;
+	queued[i] = true;
+	pending.push_back(i);
+	std::push_heap(pending.begin(), pending.end(), std::greater{});
+}
+
+float IncrementalExp::Evaluate(std::uint32_t i) const noexcept
+{
+	const Instruction& ins = instructions[i];
+	const float* s = slots.data();
+	switch (ins.op)
+	{
+		case OpCode::Value: return constants[ins.l];
+		case OpCode::Input: return values[ins.l];
+		case OpCode::Neg: return -s[ins.l];
+		case OpCode::Add: return s[ins.l] + s[ins.r];
+		case OpCode::Sub: return s[ins.l] - s[ins.r];
+		case OpCode::Mul: return s[ins.l] * s[ins.r];
+		case OpCode::Div: return s[ins.l] / s[ins.r];
+		case OpCode::Pow: return std::pow(s[ins.l], s[ins.r]);
+		case OpCode::Exp: return std::exp(s[ins.l]);
+		case OpCode::Log: return std::log(s[ins.l]);
+	}
+	return 0;
+}
+
+float IncrementalExp::Adjoint(std::uint32_t j) const noexcept
+{
+	// Same terms in the same order as CompiledExp::Gradient accumulates them, users from the last.
+	const float* s = slots.data();
+	float ret = j + 1 == instructions.size() ? 1.0f : 0.0f;
+	for (std::size_t k = user_offsets[j + 1]; k-- > user_offsets[j];)
+	{
+		const std::uint32_t i = users[k];
+		const Instruction& ins = instructions[i];
+		const float a = adjoints[i];
+		const bool l = ins.l == j, r = ins.r == j and Binary(ins.op);
+		switch (ins.op)
+		{
+			case OpCode::Value: case OpCode::Input: break;
+			case OpCode::Neg: ret -= a; break;
+			case OpCode::Add: if (l) ret += a; if (r) ret += a; break;
+			case OpCode::Sub: if (l) ret += a; if (r) ret -= a; break;
+			case OpCode::Mul: if (l) ret += a * s[ins.r]; if (r) ret += a * s[ins.l]; break;
+			case OpCode::Div: if (l) ret += a / s[ins.r]; if (r) ret -= a * s[i] / s[ins.r]; break;
+			case OpCode::Pow:
+				if (l) ret += a * PowPartial(s[ins.l], s[ins.r]);
+				if (r) ret += a * s[i] * std::log(s[ins.l]);
+				break;
+			case OpCode::Exp: ret += a * s[i]; break;
+			case OpCode::Log: ret += a / s[ins.l]; break;
+		}
+	}
+	return ret;
+}
+
+void IncrementalExp::Forward() noexcept
+{
+	if (not evaluated)
+	{
+		for (std::uint32_t i = 0; i < instructions.size(); i++)
+			slots[i] = Evaluate(i);
+		recomputed_count += instructions.size();
+		evaluated = true;
+		return;
+	}
+
+	// Operands come before their users, so the smallest pending instruction is always ready.
+	while (not pending.empty())
+	{
+		std::pop_heap(pending.begin(), pending.end(), std::greater{});
+		const std::uint32_t i = pending.back();
+		pending.pop_back();
+		queued[i] = false;
+		recomputed_count++;
+		const float value = Evaluate(i);
+		if (Same(value, slots[i]))
+			continue;
+		slots[i] = value;
+		if (differentiated and not stale[i])
+		{
+			stale[i] = true;
+			changed.push_back(i);
+		}
+		for (std::size_t k = user_offsets[i]; k < user_offsets[i + 1]; k++)
+			Push(users[k]);
+	}
+}
+
+void IncrementalExp::Reverse() noexcept
+{
+	// Same bookkeeping as 'Push', on a max-heap.
+	// Constants are skipped, nothing reads their adjoints and a shared one can have many users.
+	const auto push = [&](std::uint32_t j) {
+		if (queued[j] or instructions[j].op == OpCode::Value)
+			return;
+		queued[j] = true;
+		pending.push_back(j);
+		std::push_heap(pending.begin(), pending.end());
+	};
+	const auto push_operands = [&](std::uint32_t i) {
+		const Instruction& ins = instructions[i];
+		if (ins.op == OpCode::Value or ins.op == OpCode::Input)
+			return;
+		push(ins.l);
+		if (Binary(ins.op))
+			push(ins.r);
+	};
+	const auto invalidate = [&](std::uint32_t i) {
+		if (not Linear(instructions[i].op))
+			push_operands(i);
+	};
+
+	if (not differentiated)
+	{
+		for (std::uint32_t j = static_cast<std::uint32_t>(instructions.size()); j-- > 0;)
+			if (instructions[j].op != OpCode::Value)
+				adjoints[j] = Adjoint(j);
+		recomputed_count += instructions.size();
+		for (std::size_t k = 0; k < input_slots.size(); k++)
+			gradient[k] = input_slots[k] == none ? 0.0f : adjoints[input_slots[k]];
+		differentiated = true;
+		return;
+	}
+
+	// The partials of an instruction depend on its value and on its operands' values,
+	// so unless those partials are constants, a changed value invalidates the adjoints of its own operands
+	// and of its users' operands.
+	// Adjoints that changed in turn invalidate their operands below.
+	for (auto c : changed)
+	{
+		stale[c] = false;
+		invalidate(c);
+		for (std::size_t k = user_offsets[c]; k < user_offsets[c + 1]; k++)
+			invalidate(users[k]);
+	}
+	changed.clear();
+
+	// Users come after their operands, so the largest pending adjoint is always ready.
+	while (not pending.empty())
+	{
+		std::pop_heap(pending.begin(), pending.end());
+		const std::uint32_t j = pending.back();
+		pending.pop_back();
+		queued[j] = false;
+		recomputed_count++;
+		const float adjoint = Adjoint(j);
+		if (Same(adjoint, adjoints[j]))
+			continue;
+		adjoints[j] = adjoint;
+		if (instructions[j].op == OpCode::Input)
+			gradient[instructions[j].l] = adjoint;
+		push_operands(j);
+	}
+}
+
+void IncrementalExp::Set(std::size_t i, float value) noexcept
+{
+	assert(i < values.size());
+	if (Same(value, values[i]))
+		return;
+	values[i] = value;
+	if (evaluated and input_slots[i] != none)
+		Push(input_slots[i]);
+}
+
+float IncrementalExp::operator()() noexcept
+{
+	recomputed_count = 0;
+	Forward();
+	return slots.back();
+}
+
+float IncrementalExp::operator()(const float* inputs) noexcept
+{
+	for (std::size_t i = 0; i < values.size(); i++)
+		Set(i, inputs[i]);
+	return operator()();
+}
+
+float IncrementalExp::operator()(const std::vector<float>& inputs) noexcept
+{
+	assert(inputs.size() == values.size());
+	return operator()(inputs.data());
+}
+
+const std::vector<float>& IncrementalExp::Gradient() noexcept
+{
+	recomputed_count = 0;
+	Forward();
+	Reverse();
+	return gradient;
+}
+
+const std::vector<float>& IncrementalExp::Gradient(const float* inputs) noexcept
+{
+	for (std::size_t i = 0; i < values.size(); i++)
+		Set(i, inputs[i]);
+	return Gradient();
+}
+
+const std::vector<float>& IncrementalExp::Gradient(const std::vector<float>& inputs) noexcept
+{
+	assert(inputs.size() == values.size());
+	return Gradient(inputs.data());
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include "SymExp.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Evaluator that keeps every intermediate value and adjoint between calls and only recomputes
+// what depends on the inputs changed since the last call. A recomputed value that comes out unchanged
+// stops the propagation there.
+// The value costs the instructions downstream of the changed inputs. An adjoint depends on the values
+// of its users and on their adjoints, so the gradient also recomputes adjoints below the changed instructions,
+// which for a change close to the result can be most of the tape.
+class IncrementalExp
+{
+	std::vector<Instruction> instructions;
+	std::vector<float> constants;
+	std::vector<float> slots, adjoints;
+	std::vector<float> values, gradient; // per input
+	std::vector<std::uint32_t> input_slots; // 'Input' instruction of each input, 'none' when unused
+	std::vector<std::uint32_t> user_offsets, users; // instructions reading each slot, compressed
+	std::vector<std::uint32_t> pending; // heap of instructions to recompute
+	std::vector<std::uint32_t> changed; // slots whose value changed since the adjoints were updated
+	std::vector<std::uint8_t> queued, stale; // membership of 'pending' and of 'changed'
+	std::size_t recomputed_count = 0;
+	bool evaluated = false, differentiated = false;
+
+	static constexpr std::uint32_t none = UINT32_MAX;
+
+	void Push(std::uint32_t) noexcept; // onto the forward min-heap
+	[[nodiscard]] float Evaluate(std::uint32_t) const noexcept;
+	[[nodiscard]] float Adjoint(std::uint32_t) const noexcept;
+	void Forward() noexcept;
+	void Reverse() noexcept;
+public:
+	IncrementalExp(const SymExp&, const std::vector<Var>& vars);
+
+	[[nodiscard]] std::size_t size() const noexcept { return instructions.size(); }
+	[[nodiscard]] std::size_t inputs() const noexcept { return values.size(); }
+
+	// Instructions recomputed by the last call, values and adjoints counted separately.
+	[[nodiscard]] std::size_t recomputed() const noexcept { return recomputed_count; }
+
+	// Changes input 'i', in the order of the Vars passed to the constructor. Inputs start at 0.
+	void Set(std::size_t i, float value) noexcept;
+
+	// Value at the current inputs.
+	float operator()() noexcept;
+	// Sets every input first, only those that differ from the current ones count as changed.
+	float operator()(const float* inputs) noexcept;
+	float operator()(const std::vector<float>& inputs) noexcept;
+
+	// Reverse mode: one partial derivative per input at the current inputs.
+	// The result is overwritten by the next call.
+	const std::vector<float>& Gradient() noexcept;
+	const std::vector<float>& Gradient(const float* inputs) noexcept;
+	const std::vector<float>& Gradient(const std::vector<float>& inputs) noexcept;
+};
@@ -0,0 +1,138 @@
+#include "Jit.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+namespace
+{
+#ifdef _WIN32
+	constexpr const char* library_extension = ".dll";
+
+	void* Load(const std::string& path) { return LoadLibraryA(path.c_str()); }
+	void* Find(void* library, const std::string& name) { return reinterpret_cast<void*>(GetProcAddress(static_cast<HMODULE>(library), name.c_str())); }
+	void Unload(void* library) { FreeLibrary(static_cast<HMODULE>(library)); }
+#else
+	constexpr const char* library_extension = ".so";
+
+	void* Load(const std::string& path) { return dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL); }
+	void* Find(void* library, const std::string& name) { return dlsym(library, name.c_str()); }
+	void Unload(void* library) { dlclose(library); }
+#endif
+
+	void Replace(std::string& text, const std::string& placeholder, const std::string& value)
+	{
+		for (auto pos = text.find(placeholder); pos != std::string::npos; pos = text.find(placeholder, pos + value.size()))
+			text.replace(pos, placeholder.size(), value);
+	}
+}
+
+#ifdef _WIN32
+const char* const Jit::default_command = "cl /nologo /O2 /LD {source} /Fe{library} /Fo{library}.obj > NUL";
+#else
+const char* const Jit::default_command = "cc -O2 -shared -fPIC -o {library} {source}";
+#endif
+
+Jit::Jit(std::string command) : command(std::move(command))
+{}
+
+Jit::~Jit()
+{
+	for (auto& [hash, entry] : cache)
+		Unload(entry.library);
+	std::error_code ec;
+	for (const auto& library : libraries)
+		std::filesystem::remove(library, ec);
+}
+
+NativeFunction Jit::Compile(const SymExp& exp, const std::vector<Var>& vars)
+{
+	std::size_t hash = exp.hash();
+	for (const auto& var : vars)
+		hash = AST::HashCombine(hash, var.hash());
+
+	// Nodes are interned, so equal expressions compare equal by identity.
+	auto find = [&]() -> const Entry* {
+		auto [first, last] = cache.equal_range(hash);
+		for (auto it = first; it != last; ++it)
+			if (it->second.exp == exp and it->second.vars.size() == vars.size() and std::equal(vars.begin(), vars.end(), it->second.vars.begin()))
+				return &it->second;
+		return nullptr;
+	};
+
+	// The lock is not held while compiling, so lookups and other compiles do not wait on the compiler.
+	std::unique_lock lock(mtx);
+	if (const Entry* entry = find())
+		return entry->function;
+	const std::size_t id = counter++;
+	lock.unlock();
+
+	const std::string name = "symexp_" + std::to_string(hash);
+	const std::string source_code = exp.Generate(vars).Cpp(name);
+
+	static const auto prefix = std::to_string(std::random_device{}()) + "_";
+	const auto base = std::filesystem::temp_directory_path() / ("symexp_jit_" + prefix + std::to_string(reinterpret_cast<std::uintptr_t>(this)) + "_" + std::to_string(id));
+	const std::string source = base.string() + ".c";
+	const std::string library = base.string() + library_extension;
+	{
+		std::ofstream file(source);
+		file << source_code;
+		file.close();
+		if (not file)
+			throw std::runtime_error("JIT could not write " + source);
+	}
+
+	std::string cmd = command;
+	Replace(cmd, "{source}", '"' + source + '"');
+	Replace(cmd, "{library}", '"' + library + '"');
+	const int status = std::system(cmd.c_str());
+	std::error_code ec;
+	std::filesystem::remove(source, ec);
+	// Left next to the library by 'cl /LD': the object file and the import library with its exports file.
+	std::filesystem::remove(library + ".obj", ec);
+	std::filesystem::remove(base.string() + ".lib", ec);
+	std::filesystem::remove(base.string() + ".exp", ec);
+	if (status != 0)
+		throw std::runtime_error("JIT compilation failed: " + cmd);
+
+	lock.lock();
+	libraries.push_back(library);
+	lock.unlock();
+
+	void* handle = Load(library);
+	if (handle == nullptr)
+		throw std::runtime_error("JIT could not load " + library);
+	auto function = reinterpret_cast<NativeFunction>(Find(handle, name));
+	if (function == nullptr)
+	{
+		Unload(handle);
+		throw std::runtime_error("JIT could not find " + name + " in " + library);
+	}
+
+	// Another thread may have compiled the same expression meanwhile, the first one cached is kept.
+	lock.lock();
+	if (const Entry* entry = find())
+	{
+		Unload(handle);
+		return entry->function;
+	}
+	cache.emplace(hash, Entry{ exp, vars, handle, function });
+	return function;
+}
+
+std::size_t Jit::size()
+{
+	std::unique_lock lock(mtx);
+	return cache.size();
+}
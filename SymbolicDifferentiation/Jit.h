@@ -0,0 +1,44 @@
+#pragma once
+#include "SymExp.h"
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Native function of a SymExp, see CodeGen::Cpp.
+// Returns the value and, if 'grad' is not null, writes one partial derivative per input.
+using NativeFunction = float (*)(const float* x, float* grad);
+
+// Compiles expressions known only at runtime to native code.
+// The source from CodeGen is built into a shared library by the system compiler and loaded into the process.
+// Functions are cached by the structural hash of the expression and stay valid while the Jit lives.
+class Jit
+{
+	struct Entry
+	{
+		SymExp exp;
+		std::vector<Var> vars;
+		void* library;
+		NativeFunction function;
+	};
+
+	std::string command;
+	std::mutex mtx;
+	std::unordered_multimap<std::size_t, Entry> cache;
+	std::vector<std::string> libraries; // files, removed on destruction
+	std::size_t counter = 0;
+public:
+	// Command building '{library}' from '{source}', both placeholders are replaced by quoted paths.
+	static const char* const default_command;
+
+	explicit Jit(std::string command = default_command);
+	Jit(const Jit&) = delete;
+	Jit& operator=(const Jit&) = delete;
+	~Jit();
+
+	// Throws std::runtime_error if the compiler fails and std::invalid_argument for symbols missing from 'vars'.
+	[[nodiscard]] NativeFunction Compile(const SymExp&, const std::vector<Var>& vars);
+
+	[[nodiscard]] std::size_t size();
+};
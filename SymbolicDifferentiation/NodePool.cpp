@@ -0,0 +1,154 @@
+#include "NodePool.h"
+#include "Stats.h"
+#include <array>
+#include <mutex>
+#include <new>
+#include <utility>
+
+namespace
+{
+	constexpr std::size_t classes = NodePool::max_size / NodePool::granularity;
+	constexpr std::size_t chunk_size = 64 * 1024;
+
+	struct FreeBlock
+	{
+		FreeBlock* next;
+	};
+
+	std::size_t SizeClass(std::size_t size) noexcept
+	{
+		return size == 0 ? 0 : (size - 1) / NodePool::granularity;
+	}
+
+	// Most free blocks of one class a thread keeps, a chunk's worth.
+	constexpr std::size_t LocalLimit(std::size_t c) noexcept
+	{
+		return chunk_size / ((c + 1) * NodePool::granularity);
+	}
+
+	struct FreeList
+	{
+		FreeBlock* head = nullptr;
+		FreeBlock* tail = nullptr;
+		std::size_t count = 0;
+	};
+
+	// Blocks spilled by threads over their limit and the free lists of exited threads.
+	class SharedLists
+	{
+		std::mutex mtx;
+		std::array<FreeList, classes> free{};
+	public:
+		FreeList Take(std::size_t c)
+		{
+			std::unique_lock lock(mtx);
+			return std::exchange(free[c], {});
+		}
+
+		void Give(std::size_t c, const FreeList& list)
+		{
+			std::unique_lock lock(mtx);
+			FreeList& shared = free[c];
+			list.tail->next = shared.head;
+			if (shared.head == nullptr)
+				shared.tail = list.tail;
+			shared.head = list.head;
+			shared.count += list.count;
+		}
+	};
+
+	SharedLists& Shared()
+	{
+		static SharedLists* lists = new SharedLists(); // never destroyed, nodes may be freed during static destruction
+		return *lists;
+	}
+
+	// Trivially destructible, so it stays usable after the thread's destructors have run.
+	struct LocalLists
+	{
+		std::array<FreeList, classes> free;
+		std::byte* cursor;
+		std::byte* end;
+		bool exited;
+	};
+	thread_local LocalLists local{};
+
+	// Hands the thread's free lists over on thread exit.
+	struct LocalGuard
+	{
+		~LocalGuard()
+		{
+			for (std::size_t c = 0; c < classes; c++)
+				if (FreeList list = std::exchange(local.free[c], {}); list.head)
+					Shared().Give(c, list);
+			local.exited = true;
+		}
+	};
+
+	LocalLists& Local() noexcept
+	{
+		thread_local LocalGuard guard; // constructed on first use by each thread
+		return local;
+	}
+
+}
+
+void* NodePool::Allocate(std::size_t size)
+{
+	Stats::Allocated(size, size <= max_size);
+	if (size > max_size)
+		return ::operator new(size);
+
+	const std::size_t c = SizeClass(size);
+	if (local.exited)
+		return ::operator new((c + 1) * granularity);
+
+	LocalLists& lists = Local();
+	FreeList& list = lists.free[c];
+	if (FreeBlock* block = list.head)
+	{
+		list.head = block->next;
+		list.count--;
+		return block;
+	}
+
+	const std::size_t bytes = (c + 1) * granularity;
+	if (static_cast<std::size_t>(lists.end - lists.cursor) < bytes)
+	{
+		// Only lock once the current chunk is used up.
+		if (FreeList shared = Shared().Take(c); shared.head)
+		{
+			list = { shared.head->next, shared.tail, shared.count - 1 };
+			return shared.head;
+		}
+		lists.cursor = static_cast<std::byte*>(::operator new(chunk_size));
+		lists.end = lists.cursor + chunk_size;
+	}
+	return std::exchange(lists.cursor, lists.cursor + bytes);
+}
+
+void NodePool::Deallocate(void* p, std::size_t size) noexcept
+{
+	if (size > max_size)
+	{
+		::operator delete(p);
+		return;
+	}
+
+	const std::size_t c = SizeClass(size);
+	auto block = static_cast<FreeBlock*>(p);
+	if (local.exited)
+	{
+		Shared().Give(c, { block, block, 1 });
+		return;
+	}
+	FreeList& list = Local().free[c];
+	block->next = list.head;
+	if (list.head == nullptr)
+		list.tail = block;
+	list.head = block;
+	// Blocks freed by a thread that does not allocate them, as a consumer of another thread's nodes,
+	// would pile up here. Past the limit they go to the shared list, where allocating threads find them.
+	if (++list.count >= LocalLimit(c))
+		Shared().Give(c, std::exchange(list, {}));
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <cstddef>
+
+// Size-class free lists for AST nodes and their control blocks.
+// Each thread allocates from its own lists without locking. Blocks freed by
+// another thread join that thread's lists, up to a chunk's worth per size class.
+// The excess, and the lists of exited threads, are handed to a shared list that
+// threads pick up before taking a new chunk. Memory is kept for reuse and never
+// returned to the system.
+class NodePool
+{
+public:
+	static constexpr std::size_t granularity = 16;
+	static constexpr std::size_t max_size = 256; // larger requests go to the global heap
+
+	[[nodiscard]] static void* Allocate(std::size_t size);
+	static void Deallocate(void*, std::size_t size) noexcept;
+};
+
+template <typename T>
+class PoolAllocator
+{
+public:
+	using value_type = T;
+
+	PoolAllocator() noexcept = default;
+	template <typename U>
+	PoolAllocator(const PoolAllocator<U>&) noexcept {}
+
+	[[nodiscard]] T* allocate(std::size_t n) { return static_cast<T*>(NodePool::Allocate(n * sizeof(T))); }
+	void deallocate(T* p, std::size_t n) noexcept { NodePool::Deallocate(p, n * sizeof(T)); }
+
+	template <typename U>
+	bool operator==(const PoolAllocator<U>&) const noexcept { return true; }
+};
@@ -0,0 +1,298 @@
+#include "SymExp.h"
+#include <bit>
+#include <charconv>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+using namespace AST;
+
+namespace
+{
+	// Operator-precedence parser over an explicit stack, so nesting depth is bounded only by memory.
+	// Every token is read once. A run of '+' or of '*' at one level becomes a single sum or product,
+	// so the text of a flat sum reads back as that sum and '((a + b) + c)' as the binary sums it shows.
+	class Parser
+	{
+		enum class Frame : std::uint8_t
+		{
+			Top, Paren, PowBase, PowExponent, Exp, Log
+		};
+
+		// One nesting level. Its operands are on 'operands' from 'base'.
+		struct Level
+		{
+			Frame frame;
+			std::size_t base;
+			std::size_t sum = 0, product = 0; // first operand of the open sum and product
+			char sum_op = 0, product_op = 0; // 0 when none is open
+			std::uint32_t negations = 0; // unary minus waiting for the next operand
+		};
+
+		std::string_view text;
+		std::size_t pos = 0;
+		std::vector<NodePtr> operands;
+		std::vector<Level> levels;
+		std::unordered_map<std::string_view, NodePtr> symbols; // names seen so far, saves the symbol table lock
+		std::unordered_map<std::uint32_t, NodePtr> values; // constants seen so far by bit pattern, saves the node store lock
+
+		[[noreturn]] void Fail(const char* what) const
+		{
+			throw std::invalid_argument(std::string("SymExp::Parse: ") + what + " at offset " + std::to_string(pos) + ".");
+		}
+
+		void SkipSpace() noexcept
+		{
+			while (pos < text.size() and (text[pos] == ' ' or text[pos] == '\t' or text[pos] == '\n' or text[pos] == '\r'))
+				pos++;
+		}
+
+		[[nodiscard]] static bool NameStart(char c) noexcept
+		{
+			return (c >= 'a' and c <= 'z') or (c >= 'A' and c <= 'Z') or c == '_';
+		}
+
+		[[nodiscard]] static bool NamePart(char c) noexcept
+		{
+			return NameStart(c) or (c >= '0' and c <= '9');
+		}
+
+		// Whether a constant starts at 'at'. 'to_chars' writes the constants that are not finite as 'inf' and 'nan'.
+		[[nodiscard]] bool NumberAt(std::size_t at) const noexcept
+		{
+			if (at == text.size())
+				return false;
+			const char c = text[at];
+			if ((c >= '0' and c <= '9') or c == '.')
+				return true;
+			const auto word = text.substr(at, 3);
+			return (word == "inf" or word == "nan") and (at + 3 == text.size() or not NamePart(text[at + 3]));
+		}
+
+		// Builds the open product of 'level' if it has operands to combine.
+		void CloseProduct(Level& level)
+		{
+			if (level.product_op and operands.size() - level.product > 1)
+			{
+				// Moved, the operand stack holds the only other references.
+				NodePtr node = level.product_op == '*'
+					? Make<Mul>(Terms(std::make_move_iterator(operands.begin() + level.product), std::make_move_iterator(operands.end())))
+					: Make<Div>(std::move(operands[level.product]), std::move(operands[level.product + 1]));
+				operands.resize(level.product);
+				operands.push_back(std::move(node));
+			}
+			level.product_op = 0;
+		}
+
+		void CloseSum(Level& level)
+		{
+			CloseProduct(level);
+			if (level.sum_op and operands.size() - level.sum > 1)
+			{
+				NodePtr node = level.sum_op == '+'
+					? Make<Add>(Terms(std::make_move_iterator(operands.begin() + level.sum), std::make_move_iterator(operands.end())))
+					: Make<Sub>(std::move(operands[level.sum]), std::move(operands[level.sum + 1]));
+				operands.resize(level.sum);
+				operands.push_back(std::move(node));
+			}
+			level.sum_op = 0;
+		}
+
+		// An operand of the innermost level, after its pending negations.
+		void Operand(NodePtr node)
+		{
+			Level& level = levels.back();
+			for (; level.negations > 0; level.negations--)
+				node = Make<Neg>(std::move(node));
+			operands.push_back(std::move(node));
+		}
+
+		// 'op' after an operand. A chain of '-' or '/' stays binary, left to right.
+		void Binary(char op)
+		{
+			Level& level = levels.back();
+			if (op == '*' or op == '/')
+			{
+				if (level.product_op == '*' and op == '*')
+					return;
+				CloseProduct(level);
+				level.product = operands.size() - 1;
+				level.product_op = op;
+				return;
+			}
+			CloseProduct(level);
+			if (level.sum_op == '+' and op == '+')
+				return;
+			CloseSum(level);
+			level.sum = operands.size() - 1;
+			level.sum_op = op;
+		}
+
+		// Ends the innermost level at ')' or ',', leaving its value on 'operands'.
+		void Close()
+		{
+			Level& level = levels.back();
+			CloseSum(level);
+			if (operands.size() - level.base != 1)
+				Fail("expected an operand");
+		}
+
+		void Number()
+		{
+			float value;
+			auto [end, ec] = std::from_chars(text.data() + pos, text.data() + text.size(), value);
+			if (ec != std::errc{})
+				Fail("malformed number");
+			pos = end - text.data();
+			auto [it, inserted] = values.try_emplace(std::bit_cast<std::uint32_t>(value));
+			if (inserted)
+				it->second = Make<Value>(value);
+			Operand(it->second);
+		}
+
+		void Name()
+		{
+			const std::size_t start = pos;
+			while (pos < text.size() and NamePart(text[pos]))
+				pos++;
+			const std::string_view name = text.substr(start, pos - start);
+			SkipSpace();
+			if (pos < text.size() and text[pos] == '(')
+			{
+				Frame frame;
+				if (name == "pow")
+					frame = Frame::PowBase;
+				else if (name == "exp")
+					frame = Frame::Exp;
+				else if (name == "log")
+					frame = Frame::Log;
+				else
+				{
+					pos = start;
+					Fail("unknown function");
+				}
+				pos++;
+				levels.push_back({ frame, operands.size() });
+				return;
+			}
+			auto [it, inserted] = symbols.try_emplace(name);
+			if (inserted)
+				it->second = Make<Symbol>(std::string(name));
+			Operand(it->second);
+		}
+
+		// Reads one operand, or an opening that defers it. Returns whether an operand was completed.
+		bool ReadOperand()
+		{
+			SkipSpace();
+			if (pos == text.size())
+				Fail("expected an operand");
+			const char c = text[pos];
+			// A negative constant is written with its sign, a negation as '-(...)'.
+			if (NumberAt(pos) or (c == '-' and NumberAt(pos + 1)))
+			{
+				Number();
+				return true;
+			}
+			if (c == '-')
+			{
+				pos++;
+				levels.back().negations++;
+				return false;
+			}
+			if (c == '(')
+			{
+				pos++;
+				levels.push_back({ Frame::Paren, operands.size() });
+				return false;
+			}
+			// '$N' is how anonymous symbols are written, reading it as a name would make a new symbol.
+			if (c == '$')
+				Fail("anonymous symbols cannot be read back");
+			if (NameStart(c))
+			{
+				const auto depth = levels.size();
+				Name();
+				return levels.size() == depth;
+			}
+			Fail("expected an operand");
+		}
+
+		// Handles ')' and ','. Returns whether the innermost level became an operand of its parent.
+		bool ReadClosing(char c)
+		{
+			const Frame frame = levels.back().frame;
+			if (c == ',')
+			{
+				if (frame != Frame::PowBase)
+					Fail("unexpected ','");
+				Close();
+				pos++;
+				levels.back() = { Frame::PowExponent, operands.size() };
+				return false;
+			}
+			if (frame == Frame::Top or frame == Frame::PowBase)
+				Fail("unexpected ')'");
+			Close();
+			pos++;
+			NodePtr node;
+			switch (frame)
+			{
+				case Frame::PowExponent:
+					node = Make<Pow>(std::move(operands[operands.size() - 2]), std::move(operands.back()));
+					operands.pop_back();
+					break;
+				case Frame::Exp: node = Make<Exp>(std::move(operands.back())); break;
+				case Frame::Log: node = Make<Log>(std::move(operands.back())); break;
+				default: node = std::move(operands.back()); break;
+			}
+			operands.pop_back();
+			levels.pop_back();
+			Operand(std::move(node));
+			return true;
+		}
+	public:
+		explicit Parser(std::string_view text) noexcept : text(text) {}
+
+		NodePtr Run()
+		{
+			levels.push_back({ Frame::Top, 0 });
+			bool operand = false; // the last item read was a complete operand, an operator or closing comes next
+			for (;;)
+			{
+				if (not operand)
+				{
+					operand = ReadOperand();
+					continue;
+				}
+				SkipSpace();
+				if (pos == text.size())
+					break;
+				const char c = text[pos];
+				if (c == '+' or c == '-' or c == '*' or c == '/')
+				{
+					pos++;
+					Binary(c);
+					operand = false;
+				}
+				else if (c == ')' or c == ',')
+					operand = ReadClosing(c);
+				else
+					Fail("expected an operator");
+			}
+			if (levels.size() != 1)
+				Fail("missing ')'");
+			Close();
+			return operands.back();
+		}
+	};
+}
+
+SymExp SymExp::Parse(std::string_view text)
+{
+	Stats::Scope scope(Stats::Pass::Parse);
+	return SymExp{ Parser(text).Run() };
+}
@@ -0,0 +1,219 @@
+#include "Serialize.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <type_traits>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// The tape is used in place, so its layout is part of the format.
+static_assert(std::is_trivially_copyable_v<Instruction> and sizeof(Instruction) == 12);
+static_assert(offsetof(Instruction, op) == 0 and offsetof(Instruction, l) == 4 and offsetof(Instruction, r) == 8);
+static_assert(sizeof(SymExpHeader) % alignof(Instruction) == 0 and sizeof(Instruction) % alignof(float) == 0);
+
+namespace
+{
+	constexpr char magic[8] = { 'S', 'y', 'm', 'E', 'x', 'p', '\0', '\x01' };
+	constexpr std::uint32_t version = 1;
+
+	struct Mapping
+	{
+		std::shared_ptr<const void> data;
+		std::size_t size = 0;
+	};
+
+#ifdef _WIN32
+	Mapping Map(const std::string& path)
+	{
+		HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			throw std::runtime_error("Could not open " + path);
+		LARGE_INTEGER size;
+		if (not GetFileSizeEx(file, &size) or size.QuadPart < static_cast<LONGLONG>(sizeof(SymExpHeader)))
+		{
+			CloseHandle(file);
+			throw std::runtime_error("Not an expression file: " + path);
+		}
+		HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		CloseHandle(file);
+		if (not mapping)
+			throw std::runtime_error("Could not map " + path);
+		// The view keeps the mapping alive.
+		const void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(mapping);
+		if (not view)
+			throw std::runtime_error("Could not map " + path);
+		return { std::shared_ptr<const void>(view, [](const void* p) { UnmapViewOfFile(p); }), static_cast<std::size_t>(size.QuadPart) };
+	}
+#else
+	Mapping Map(const std::string& path)
+	{
+		const int file = open(path.c_str(), O_RDONLY);
+		if (file < 0)
+			throw std::runtime_error("Could not open " + path);
+		struct stat status;
+		if (fstat(file, &status) != 0 or status.st_size < static_cast<off_t>(sizeof(SymExpHeader)))
+		{
+			close(file);
+			throw std::runtime_error("Not an expression file: " + path);
+		}
+		const auto size = static_cast<std::size_t>(status.st_size);
+		// The mapping outlives the descriptor.
+		void* view = mmap(nullptr, size, PROT_READ, MAP_SHARED, file, 0);
+		close(file);
+		if (view == MAP_FAILED)
+			throw std::runtime_error("Could not map " + path);
+		return { std::shared_ptr<const void>(view, [size](const void* p) { munmap(const_cast<void*>(p), size); }), size };
+	}
+#endif
+
+	// Operands must be earlier slots, so evaluation never reads past the instruction being computed.
+	[[nodiscard]] bool Valid(const Instruction& ins, std::size_t i, const SymExpHeader& header) noexcept
+	{
+		switch (ins.op)
+		{
+			case OpCode::Value: return ins.l < header.constant_count;
+			case OpCode::Input: return ins.l < header.input_count;
+			case OpCode::Neg: case OpCode::Exp: case OpCode::Log: return ins.l < i;
+			case OpCode::Add: case OpCode::Sub: case OpCode::Mul: case OpCode::Div: case OpCode::Pow: return ins.l < i and ins.r < i;
+		}
+		return false;
+	}
+}
+
+void MappedExp::Save(const SymExp& exp, const std::vector<Var>& vars, const std::string& path)
+{
+	const CompiledExp compiled = exp.Compile(vars);
+
+	std::vector<std::uint32_t> offsets{ 0 };
+	std::string characters;
+	for (const auto& var : vars)
+	{
+		auto symbol = dynamic_cast<const AST::Symbol*>(var.root.get());
+		if (not symbol or AST::SymbolNamed(symbol->id()))
+			characters += var.to_string();
+		offsets.push_back(static_cast<std::uint32_t>(characters.size()));
+	}
+
+	SymExpHeader header{};
+	std::memcpy(header.magic, magic, sizeof magic);
+	header.version = version;
+	header.instruction_count = static_cast<std::uint32_t>(compiled.instructions.size());
+	header.constant_count = static_cast<std::uint32_t>(compiled.constants.size());
+	header.input_count = static_cast<std::uint32_t>(vars.size());
+	header.name_size = static_cast<std::uint32_t>(characters.size());
+
+	// Written field by field, so the padding of each instruction is zero.
+	std::vector<std::byte> tape(compiled.instructions.size() * sizeof(Instruction));
+	for (std::size_t i = 0; i < compiled.instructions.size(); i++)
+	{
+		const Instruction& ins = compiled.instructions[i];
+		std::byte* record = tape.data() + i * sizeof(Instruction);
+		std::memcpy(record + offsetof(Instruction, op), &ins.op, sizeof ins.op);
+		std::memcpy(record + offsetof(Instruction, l), &ins.l, sizeof ins.l);
+		std::memcpy(record + offsetof(Instruction, r), &ins.r, sizeof ins.r);
+	}
+
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	out.write(reinterpret_cast<const char*>(&header), sizeof header);
+	out.write(reinterpret_cast<const char*>(tape.data()), tape.size());
+	out.write(reinterpret_cast<const char*>(compiled.constants.data()), compiled.constants.size() * sizeof(float));
+	out.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(std::uint32_t));
+	out.write(characters.data(), characters.size());
+	out.close();
+	if (not out)
+		throw std::runtime_error("Could not write " + path);
+}
+
+MappedExp::MappedExp(const std::string& path)
+{
+	auto [data, size] = Map(path);
+	const auto* bytes = static_cast<const std::byte*>(data.get());
+	SymExpHeader header;
+	std::memcpy(&header, bytes, sizeof header);
+	if (std::memcmp(header.magic, magic, sizeof magic) != 0 or header.version != version)
+		throw std::runtime_error("Not an expression file: " + path);
+
+	const std::uint64_t tape_size = std::uint64_t{ header.instruction_count } * sizeof(Instruction);
+	const std::uint64_t constants_size = std::uint64_t{ header.constant_count } * sizeof(float);
+	const std::uint64_t offsets_size = (std::uint64_t{ header.input_count } + 1) * sizeof(std::uint32_t);
+	if (header.instruction_count == 0 or sizeof header + tape_size + constants_size + offsets_size + header.name_size != size)
+		throw std::runtime_error("Truncated or corrupt expression file: " + path);
+
+	bytes += sizeof header;
+	instructions = { reinterpret_cast<const Instruction*>(bytes), header.instruction_count };
+	bytes += tape_size;
+	constants = { reinterpret_cast<const float*>(bytes), header.constant_count };
+	bytes += constants_size;
+	name_offsets = { reinterpret_cast<const std::uint32_t*>(bytes), header.input_count + std::size_t{ 1 } };
+	bytes += offsets_size;
+	names = reinterpret_cast<const char*>(bytes);
+
+	for (std::size_t i = 0; i < instructions.size(); i++)
+		if (not Valid(instructions[i], i, header))
+			throw std::runtime_error("Corrupt expression file: " + path);
+	if (name_offsets.front() != 0 or name_offsets.back() != header.name_size or not std::is_sorted(name_offsets.begin(), name_offsets.end()))
+		throw std::runtime_error("Corrupt expression file: " + path);
+	mapping = std::move(data);
+}
+
+std::string_view MappedExp::name(std::size_t input) const noexcept
+{
+	return { names + name_offsets[input], name_offsets[input + 1] - name_offsets[input] };
+}
+
+CompiledExp MappedExp::Compile() const
+{
+	return { mapping, instructions, constants, inputs() };
+}
+
+std::vector<Var> MappedExp::vars() const
+{
+	std::vector<Var> ret;
+	ret.reserve(inputs());
+	for (std::size_t i = 0; i < inputs(); i++)
+		if (name(i).empty())
+			ret.emplace_back();
+		else
+			ret.emplace_back(std::string(name(i)));
+	return ret;
+}
+
+SymExp MappedExp::Rebuild() const
+{
+	return Rebuild(vars());
+}
+
+SymExp MappedExp::Rebuild(const std::vector<Var>& vars) const
+{
+	if (vars.size() != inputs())
+		throw std::invalid_argument("MappedExp::Rebuild needs one Var per input.");
+	std::vector<SymExp> slots;
+	slots.reserve(instructions.size());
+	for (const Instruction& ins : instructions)
+		switch (ins.op)
+		{
+			case OpCode::Value: slots.emplace_back(constants[ins.l]); break;
+			case OpCode::Input: slots.push_back(vars[ins.l]); break;
+			case OpCode::Neg: slots.push_back(-slots[ins.l]); break;
+			case OpCode::Add: slots.push_back(slots[ins.l] + slots[ins.r]); break;
+			case OpCode::Sub: slots.push_back(slots[ins.l] - slots[ins.r]); break;
+			case OpCode::Mul: slots.push_back(slots[ins.l] * slots[ins.r]); break;
+			case OpCode::Div: slots.push_back(slots[ins.l] / slots[ins.r]); break;
+			case OpCode::Pow: slots.push_back(pow(slots[ins.l], slots[ins.r])); break;
+			case OpCode::Exp: slots.push_back(exp(slots[ins.l])); break;
+			case OpCode::Log: slots.push_back(log(slots[ins.l])); break;
+		}
+	return slots.back();
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include "SymExp.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Binary form of an expression lowered over a list of Vars, for files generated once and loaded by many processes.
+// Laid out so that a mapped file is used in place, in the byte order of the writer:
+//   header      'SymExpHeader'
+//   tape        'instruction_count' Instructions in postorder, the result last
+//   constants   'constant_count' floats
+//   names       'input_count + 1' uint32 offsets into the characters that follow, then the characters
+// Inputs are in the order of the Vars, each named after its symbol. Anonymous symbols are stored without a name.
+struct SymExpHeader
+{
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t instruction_count;
+	std::uint32_t constant_count;
+	std::uint32_t input_count;
+	std::uint32_t name_size;
+	std::uint32_t reserved;
+};
+
+// Read-only mapping of a file written by 'MappedExp::Save'.
+// Loading validates the file in one pass and allocates nothing per node. The mapping is shared by
+// every CompiledExp made from it and stays alive as long as any of them does, and the pages are shared
+// between the processes mapping the same file.
+class MappedExp
+{
+	std::shared_ptr<const void> mapping;
+	std::span<const Instruction> instructions;
+	std::span<const float> constants;
+	std::span<const std::uint32_t> name_offsets;
+	const char* names = nullptr;
+public:
+	// Throws std::runtime_error if the file cannot be mapped or is not a valid expression file.
+	explicit MappedExp(const std::string& path);
+
+	// Lowers 'exp' over 'vars' and writes it to 'path'. Throws std::runtime_error if the file cannot be written.
+	static void Save(const SymExp& exp, const std::vector<Var>& vars, const std::string& path);
+
+	[[nodiscard]] std::size_t size() const noexcept { return instructions.size(); }
+	[[nodiscard]] std::size_t inputs() const noexcept { return name_offsets.size() - 1; }
+	// Name of the input's symbol, empty for an anonymous one.
+	[[nodiscard]] std::string_view name(std::size_t input) const noexcept;
+
+	// Evaluator running on the mapped tape, only its slots are allocated.
+	[[nodiscard]] CompiledExp Compile() const;
+
+	// One Var per input, named as stored. Symbols with the same name share an ID, so these are the
+	// Vars the file was saved with when they were named. An anonymous input gets a new anonymous Var on
+	// each call, pass the saved Vars to 'Rebuild' to get the original symbols back.
+	[[nodiscard]] std::vector<Var> vars() const;
+
+	// The expression as a tree again, over 'vars()' or over the given Vars.
+	// Throws std::invalid_argument unless there is one Var per input.
+	[[nodiscard]] SymExp Rebuild() const;
+	[[nodiscard]] SymExp Rebuild(const std::vector<Var>& vars) const;
+};
@@ -0,0 +1,203 @@
+#include "Sparse.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <unordered_map>
+
+using namespace AST;
+
+std::vector<std::uint32_t> SparsityPattern::Coloring() const
+{
+	// Rows of each column.
+	std::vector<std::size_t> column_offsets(cols + 1);
+	for (auto col : columns)
+		column_offsets[col + 1]++;
+	for (std::size_t j = 0; j < cols; j++)
+		column_offsets[j + 1] += column_offsets[j];
+	std::vector<std::uint32_t> column_rows(columns.size());
+	auto next = column_offsets;
+	for (std::size_t i = 0; i < rows; i++)
+		for (std::size_t k = offsets[i]; k < offsets[i + 1]; k++)
+			column_rows[next[columns[k]]++] = static_cast<std::uint32_t>(i);
+
+	// Densest columns first, they are the most constrained.
+	std::vector<std::uint32_t> order(cols);
+	for (std::uint32_t j = 0; j < cols; j++)
+		order[j] = j;
+	std::stable_sort(order.begin(), order.end(), [&](std::uint32_t a, std::uint32_t b) {
+		return column_offsets[a + 1] - column_offsets[a] > column_offsets[b + 1] - column_offsets[b];
+	});
+
+	constexpr std::uint32_t none = UINT32_MAX;
+	std::vector<std::uint32_t> colors(cols, none);
+	std::vector<std::uint32_t> forbidden; // column that last excluded each color
+	for (auto j : order)
+	{
+		for (std::size_t r = column_offsets[j]; r < column_offsets[j + 1]; r++)
+		{
+			const auto row = column_rows[r];
+			for (std::size_t k = offsets[row]; k < offsets[row + 1]; k++)
+				if (auto c = colors[columns[k]]; c != none)
+					forbidden[c] = j;
+		}
+		std::uint32_t c = 0;
+		while (c < forbidden.size() and forbidden[c] == j)
+			c++;
+		if (c == forbidden.size())
+			forbidden.push_back(none);
+		colors[j] = c;
+	}
+	return colors;
+}
+
+
+
+SparsityPattern JacobianSparsity(const SymExpVec& outputs, const std::vector<Var>& vars)
+{
+	std::unordered_map<std::uint32_t, std::uint32_t> column; // symbol ID -> column
+	SymbolSet mask;
+	for (std::uint32_t j = 0; j < vars.size(); j++)
+	{
+		const auto& symbol = static_cast<const Symbol&>(*vars[j].root);
+		column.emplace(symbol.id(), j);
+		mask |= symbol.symbols();
+	}
+
+	SparsityPattern ret;
+	ret.rows = outputs.size();
+	ret.cols = vars.size();
+	ret.offsets.reserve(outputs.size() + 1);
+	for (const auto& output : outputs)
+	{
+		const auto first = ret.columns.size();
+		if (output.root->symbols().intersects(mask))
+			for (const Node* node : Postorder(*output.root))
+				if (auto symbol = dynamic_cast<const Symbol*>(node))
+					if (auto it = column.find(symbol->id()); it != column.end())
+						ret.columns.push_back(it->second);
+		std::sort(ret.columns.begin() + first, ret.columns.end());
+		ret.offsets.push_back(ret.columns.size());
+	}
+	return ret;
+}
+
+SparseMatrix<SymExp> Jacobian(const SymExpVec& outputs, const std::vector<Var>& vars)
+{
+	SparseMatrix<SymExp> ret;
+	static_cast<SparsityPattern&>(ret) = JacobianSparsity(outputs, vars);
+	ret.values.reserve(ret.nonzeros());
+	auto output = outputs.begin();
+	for (std::size_t i = 0; i < ret.rows; i++, ++output)
+		for (std::size_t k = ret.offsets[i]; k < ret.offsets[i + 1]; k++)
+			ret.values.push_back(output->Derive(vars[ret.columns[k]]));
+	return ret;
+}
+
+SparseMatrix<SymExp> Hessian(const SymExp& exp, const std::vector<Var>& vars)
+{
+	return Jacobian(exp.Gradient(vars), vars);
+}
+
+
+
+SparseJacobian::SparseJacobian(const SymExpVec& outputs, const std::vector<Var>& vars)
+{
+	static_cast<SparsityPattern&>(matrix) = JacobianSparsity(outputs, vars);
+	matrix.values.resize(matrix.nonzeros());
+	column_colors = matrix.Coloring();
+	for (auto c : column_colors)
+		color_count = std::max<std::size_t>(color_count, c + 1);
+
+	Tape tape = SymExp::Lower(vars);
+	results.reserve(outputs.size());
+	for (const auto& output : outputs)
+		results.push_back(tape.Compile(*output.root));
+	instructions = std::move(tape.instructions);
+	constants = std::move(tape.constants);
+	slots.resize(instructions.size());
+	tangents.resize(instructions.size() * color_count);
+}
+
+SparseJacobian SparseJacobian::Hessian(const SymExp& exp, const std::vector<Var>& vars)
+{
+	return { exp.Gradient(vars), vars };
+}
+
+const SparseMatrix<float>& SparseJacobian::operator()(const float* inputs) noexcept
+{
+	const std::size_t n = color_count;
+	float* s = slots.data();
+	for (std::size_t i = 0; i < instructions.size(); i++)
+	{
+		const Instruction& ins = instructions[i];
+		float* t = tangents.data() + i * n;
+		// 'l' indexes the constants of 'Value' and the inputs of 'Input', not a slot, so operands are only loaded
+		// by the other cases. 'r' is 0 where it is unused.
+		const bool leaf = ins.op == OpCode::Value or ins.op == OpCode::Input;
+		const float* tl = leaf ? nullptr : tangents.data() + ins.l * n;
+		const float* tr = tangents.data() + ins.r * n;
+		switch (ins.op)
+		{
+			case OpCode::Value:
+				s[i] = constants[ins.l];
+				std::fill_n(t, n, 0.0f);
+				break;
+			case OpCode::Input:
+				s[i] = inputs[ins.l];
+				std::fill_n(t, n, 0.0f);
+				if (n > 0)
+					t[column_colors[ins.l]] = 1;
+				break;
+			case OpCode::Neg: s[i] = -s[ins.l]; for (std::size_t c = 0; c < n; c++) t[c] = -tl[c]; break;
+			case OpCode::Add: s[i] = s[ins.l] + s[ins.r]; for (std::size_t c = 0; c < n; c++) t[c] = tl[c] + tr[c]; break;
+			case OpCode::Sub: s[i] = s[ins.l] - s[ins.r]; for (std::size_t c = 0; c < n; c++) t[c] = tl[c] - tr[c]; break;
+			case OpCode::Mul:
+			{
+				const float l = s[ins.l], r = s[ins.r];
+				s[i] = l * r;
+				for (std::size_t c = 0; c < n; c++) t[c] = tl[c] * r + l * tr[c];
+				break;
+			}
+			case OpCode::Div:
+			{
+				const float r = s[ins.r];
+				s[i] = s[ins.l] / r;
+				for (std::size_t c = 0; c < n; c++) t[c] = (tl[c] - s[i] * tr[c]) / r;
+				break;
+			}
+			case OpCode::Pow:
+			{
+				const float l = s[ins.l], r = s[ins.r];
+				s[i] = std::pow(l, r);
+				// Zero tangents contribute nothing, even where the partial derivative is not finite.
+				const float dl = PowPartial(l, r), dr = s[i] * std::log(l);
+				for (std::size_t c = 0; c < n; c++)
+					t[c] = (tl[c] != 0 ? tl[c] * dl : 0.0f) + (tr[c] != 0 ? tr[c] * dr : 0.0f);
+				break;
+			}
+			case OpCode::Exp: s[i] = std::exp(s[ins.l]); for (std::size_t c = 0; c < n; c++) t[c] = tl[c] * s[i]; break;
+			case OpCode::Log:
+			{
+				const float l = s[ins.l];
+				s[i] = std::log(l);
+				for (std::size_t c = 0; c < n; c++) t[c] = tl[c] / l;
+				break;
+			}
+		}
+	}
+
+	// Within a row each color belongs to a single column.
+	for (std::size_t i = 0; i < matrix.rows; i++)
+	{
+		const float* t = tangents.data() + results[i] * n;
+		for (std::size_t k = matrix.offsets[i]; k < matrix.offsets[i + 1]; k++)
+			matrix.values[k] = t[column_colors[matrix.columns[k]]];
+	}
+	return matrix;
+}
+
+const SparseMatrix<float>& SparseJacobian::operator()(const std::vector<float>& inputs) noexcept
+{
+	assert(inputs.size() == column_colors.size());
+	return operator()(inputs.data());
+}
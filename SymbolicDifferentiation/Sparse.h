@@ -0,0 +1,61 @@
+#pragma once
+#include "SymExp.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Structural nonzeros in compressed sparse row form.
+// The nonzeros of row i are in columns 'columns[offsets[i]]' to 'columns[offsets[i + 1] - 1]', ascending.
+struct SparsityPattern
+{
+	std::size_t rows = 0, cols = 0;
+	std::vector<std::size_t> offsets{ 0 }; // 'rows + 1' entries
+	std::vector<std::uint32_t> columns;
+
+	[[nodiscard]] std::size_t nonzeros() const noexcept { return columns.size(); }
+
+	// Greedy distance-2 coloring: columns sharing a row get different colors.
+	// Returns the color of each column, colors are numbered from 0.
+	[[nodiscard]] std::vector<std::uint32_t> Coloring() const;
+};
+
+// Sparse matrix, 'values[k]' is the entry in 'columns[k]'.
+template <typename T>
+struct SparseMatrix : SparsityPattern
+{
+	std::vector<T> values;
+};
+
+// Jacobian entry (i, j) is structurally nonzero when output i mentions 'vars[j]'.
+[[nodiscard]] SparsityPattern JacobianSparsity(const SymExpVec& outputs, const std::vector<Var>& vars);
+
+// Symbolic Jacobian and Hessian. Only the structural nonzeros are derived.
+[[nodiscard]] SparseMatrix<SymExp> Jacobian(const SymExpVec& outputs, const std::vector<Var>& vars);
+[[nodiscard]] SparseMatrix<SymExp> Hessian(const SymExp&, const std::vector<Var>& vars);
+
+// Reusable evaluator of a sparse Jacobian.
+// Columns of one color never share a row, so a single forward sweep with one tangent per color
+// recovers every nonzero, and evaluating costs the tape size times the number of colors.
+class SparseJacobian
+{
+	SparseMatrix<float> matrix;
+	std::vector<Instruction> instructions;
+	std::vector<float> constants;
+	std::vector<std::uint32_t> results; // slot of each output
+	std::vector<std::uint32_t> column_colors;
+	std::size_t color_count = 0;
+	std::vector<float> slots, tangents; // 'color_count' tangents per instruction
+public:
+	SparseJacobian(const SymExpVec& outputs, const std::vector<Var>& vars);
+
+	// The Hessian, as the Jacobian of the gradient.
+	[[nodiscard]] static SparseJacobian Hessian(const SymExp&, const std::vector<Var>& vars);
+
+	[[nodiscard]] const SparsityPattern& pattern() const noexcept { return matrix; }
+	[[nodiscard]] std::size_t colors() const noexcept { return color_count; }
+
+	// 'inputs' holds one value per Var, in the order passed to the constructor.
+	// The result is overwritten by the next evaluation.
+	const SparseMatrix<float>& operator()(const float* inputs) noexcept;
+	const SparseMatrix<float>& operator()(const std::vector<float>& inputs) noexcept;
+};
@@ -0,0 +1,29 @@
+#include "StaticExp.h"
+#include <type_traits>
+
+// The header is all templates. These checks instantiate its folds and derivatives, so it is compiled with the library.
+namespace Static
+{
+	namespace
+	{
+		constexpr Symbol<0> x;
+		constexpr Symbol<1> y;
+
+		static_assert(std::is_same_v<decltype(MakeSub(Value<0.0f>{}, Value<2.0f>{})), Value<-2.0f>>);
+		static_assert(std::is_same_v<decltype(MakeSub(Value<0.0f>{}, x)), Neg<Symbol<0>>>);
+		static_assert(std::is_same_v<decltype(MakeSub(Value<0.0f>{}, Neg<Symbol<0>>{})), Symbol<0>>);
+		static_assert(std::is_same_v<decltype(MakeAdd(x, Value<0.0f>{})), Symbol<0>>);
+		static_assert(std::is_same_v<decltype(MakeMul(Value<0.0f>{}, y)), Value<0.0f>>);
+		static_assert(std::is_same_v<decltype(MakeDiv(x, Value<1.0f>{})), Symbol<0>>);
+		static_assert(std::is_same_v<decltype(MakePow(Value<2.0f>{}, Value<3.0f>{})), Value<8.0f>>);
+		static_assert(std::is_same_v<decltype(MakeExp(Log<Symbol<1>>{})), Symbol<1>>);
+		static_assert(std::is_same_v<decltype(Simplify(Neg<Neg<Symbol<0>>>{})), Symbol<0>>);
+
+		// The example at the top of the header.
+		static_assert(std::is_same_v<decltype(Derive<0>(x * y + exp(x))), Add<Symbol<1>, Exp<Symbol<0>>>>);
+		static_assert(std::is_same_v<decltype(Derive<1>(x * y + exp(x))), Symbol<0>>);
+
+		constexpr float inputs[] = { 2.0f, 3.0f };
+		static_assert((x * y - y)(inputs) == 3.0f);
+	}
+}
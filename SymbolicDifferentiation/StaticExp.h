@@ -0,0 +1,343 @@
+#pragma once
+#include "SymExp.h"
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+// Compile-time mirror of the AST for formulas known statically.
+// Expressions are empty types: derivatives and simplification are type transformations done by the compiler,
+// and evaluating is inlined arithmetic without allocation or virtual calls.
+//
+//	constexpr Static::Symbol<0> x;
+//	constexpr Static::Symbol<1> y;
+//	constexpr auto f = x * y + exp(x);
+//	constexpr auto df = Static::Derive<0>(f); // (y + exp(x))
+//	float value = df(inputs);
+//	SymExp runtime = df.ToSymExp({ X, Y });
+namespace Static
+{
+	struct Tag {};
+
+	template <typename T>
+	concept Expression = std::is_base_of_v<Tag, T>;
+
+	// Base of every expression, 'E' is the expression itself.
+	template <typename E>
+	struct Node : Tag
+	{
+		// 'x' holds one value per symbol index.
+		[[nodiscard]] constexpr float operator()(const float* x) const noexcept { return E::Eval(x); }
+
+		// Runtime expression, symbol 'I' becomes 'vars[I]'.
+		[[nodiscard]] SymExp ToSymExp(const std::vector<Var>& vars) const { return E::Build(vars); }
+	};
+
+	template <float V>
+	struct Value : Node<Value<V>>
+	{
+		static constexpr float value = V;
+		[[nodiscard]] static constexpr float Eval(const float*) noexcept { return V; }
+		[[nodiscard]] static SymExp Build(const std::vector<Var>&) { return SymExp{ V }; }
+	};
+
+	template <std::size_t I>
+	struct Symbol : Node<Symbol<I>>
+	{
+		static constexpr std::size_t index = I;
+		[[nodiscard]] static constexpr float Eval(const float* x) noexcept { return x[I]; }
+		[[nodiscard]] static SymExp Build(const std::vector<Var>& vars) { assert(I < vars.size()); return vars[I]; }
+	};
+
+	template <Expression N>
+	struct Neg : Node<Neg<N>>
+	{
+		using operand = N;
+		[[nodiscard]] static constexpr float Eval(const float* x) noexcept { return -N::Eval(x); }
+		[[nodiscard]] static SymExp Build(const std::vector<Var>& vars) { return -N::Build(vars); }
+	};
+
+	template <Expression L, Expression R>
+	struct Add : Node<Add<L, R>>
+	{
+		[[nodiscard]] static constexpr float Eval(const float* x) noexcept { return L::Eval(x) + R::Eval(x); }
+		[[nodiscard]] static SymExp Build(const std::vector<Var>& vars) { return L::Build(vars) + R::Build(vars); }
+	};
+
+	template <Expression L, Expression R>
+	struct Sub : Node<Sub<L, R>>
+	{
+		[[nodiscard]] static constexpr float Eval(const float* x) noexcept { return L::Eval(x) - R::Eval(x); }
+		[[nodiscard]] static SymExp Build(const std::vector<Var>& vars) { return L::Build(vars) - R::Build(vars); }
+	};
+
+	template <Expression L, Expression R>
+	struct Mul : Node<Mul<L, R>>
+	{
+		[[nodiscard]] static constexpr float Eval(const float* x) noexcept { return L::Eval(x) * R::Eval(x); }
+		[[nodiscard]] static SymExp Build(const std::vector<Var>& vars) { return L::Build(vars) * R::Build(vars); }
+	};
+
+	template <Expression L, Expression R>
+	struct Div : Node<Div<L, R>>
+	{
+		[[nodiscard]] static constexpr float Eval(const float* x) noexcept { return L::Eval(x) / R::Eval(x); }
+		[[nodiscard]] static SymExp Build(const std::vector<Var>& vars) { return L::Build(vars) / R::Build(vars); }
+	};
+
+	template <Expression L, Expression R>
+	struct Pow : Node<Pow<L, R>>
+	{
+		[[nodiscard]] static float Eval(const float* x) noexcept { return std::pow(L::Eval(x), R::Eval(x)); }
+		[[nodiscard]] static SymExp Build(const std::vector<Var>& vars) { return pow(L::Build(vars), R::Build(vars)); }
+	};
+
+	template <Expression N>
+	struct Exp : Node<Exp<N>>
+	{
+		using operand = N;
+		[[nodiscard]] static float Eval(const float* x) noexcept { return std::exp(N::Eval(x)); }
+		[[nodiscard]] static SymExp Build(const std::vector<Var>& vars) { return exp(N::Build(vars)); }
+	};
+
+	template <Expression N>
+	struct Log : Node<Log<N>>
+	{
+		using operand = N;
+		[[nodiscard]] static float Eval(const float* x) noexcept { return std::log(N::Eval(x)); }
+		[[nodiscard]] static SymExp Build(const std::vector<Var>& vars) { return log(N::Build(vars)); }
+	};
+
+	template <Expression L, Expression R> [[nodiscard]] constexpr Add<L, R> operator+(L, R) noexcept { return {}; }
+	template <Expression L, Expression R> [[nodiscard]] constexpr Sub<L, R> operator-(L, R) noexcept { return {}; }
+	template <Expression L, Expression R> [[nodiscard]] constexpr Mul<L, R> operator*(L, R) noexcept { return {}; }
+	template <Expression L, Expression R> [[nodiscard]] constexpr Div<L, R> operator/(L, R) noexcept { return {}; }
+	template <Expression L, Expression R> [[nodiscard]] constexpr Pow<L, R> pow(L, R) noexcept { return {}; }
+	template <Expression N> [[nodiscard]] constexpr Neg<N> operator-(N) noexcept { return {}; }
+	template <Expression N> [[nodiscard]] constexpr Exp<N> exp(N) noexcept { return {}; }
+	template <Expression N> [[nodiscard]] constexpr Log<N> log(N) noexcept { return {}; }
+
+	template <typename T> inline constexpr bool is_value = false;
+	template <float V> inline constexpr bool is_value<Value<V>> = true;
+	template <typename T> inline constexpr bool is_neg = false;
+	template <typename N> inline constexpr bool is_neg<Neg<N>> = true;
+	template <typename T> inline constexpr bool is_exp = false;
+	template <typename N> inline constexpr bool is_exp<Exp<N>> = true;
+	template <typename T> inline constexpr bool is_log = false;
+	template <typename N> inline constexpr bool is_log<Log<N>> = true;
+
+	template <typename T>
+	[[nodiscard]] constexpr bool Is(float value) noexcept
+	{
+		if constexpr (is_value<T>)
+			return T::value == value;
+		else
+			return false;
+	}
+
+	// Smart constructors over already simplified operands. They fold constants, the identities of 0 and 1,
+	// double negation and exp/log pairs. Unlike the runtime 'Simplify', sums and products stay binary in the
+	// order they were written, and like terms and powers of a base are not collected.
+	// Constants are folded where the arithmetic is constexpr, so 'exp', 'log' and non-integer 'pow' of constants stay unevaluated.
+
+	template <Expression N>
+	[[nodiscard]] constexpr auto MakeNeg(N) noexcept
+	{
+		if constexpr (is_value<N>)
+			return Value<-N::value>{};
+		else if constexpr (is_neg<N>)
+			return typename N::operand{};
+		else
+			return Neg<N>{};
+	}
+
+	template <Expression L, Expression R>
+	[[nodiscard]] constexpr auto MakeAdd(L, R) noexcept
+	{
+		if constexpr (is_value<L> and is_value<R>)
+			return Value<L::value + R::value>{};
+		else if constexpr (Is<L>(0))
+			return R{};
+		else if constexpr (Is<R>(0))
+			return L{};
+		else
+			return Add<L, R>{};
+	}
+
+	template <Expression L, Expression R>
+	[[nodiscard]] constexpr auto MakeSub(L, R) noexcept
+	{
+		if constexpr (is_value<L> and is_value<R>)
+			return Value<L::value - R::value>{};
+		else if constexpr (Is<L>(0))
+			return MakeNeg(R{});
+		else if constexpr (Is<R>(0))
+			return L{};
+		else
+			return Sub<L, R>{};
+	}
+
+	template <Expression L, Expression R>
+	[[nodiscard]] constexpr auto MakeMul(L, R) noexcept
+	{
+		if constexpr (is_value<L> and is_value<R>)
+			return Value<L::value * R::value>{};
+		else if constexpr (Is<L>(0) or Is<R>(0))
+			return Value<0.0f>{};
+		else if constexpr (Is<L>(1))
+			return R{};
+		else if constexpr (Is<R>(1))
+			return L{};
+		else
+			return Mul<L, R>{};
+	}
+
+	template <Expression L, Expression R>
+	[[nodiscard]] constexpr auto MakeDiv(L, R) noexcept
+	{
+		if constexpr (is_value<L> and is_value<R> and not Is<R>(0)) // division by zero is not a constant expression
+			return Value<L::value / R::value>{};
+		else if constexpr (Is<L>(0))
+			return Value<0.0f>{};
+		else if constexpr (Is<R>(0))
+			return Value<std::numeric_limits<float>::infinity()>{};
+		else if constexpr (Is<R>(1))
+			return L{};
+		else
+			return Div<L, R>{};
+	}
+
+	[[nodiscard]] constexpr float IntegerPower(float base, int power) noexcept
+	{
+		float ret = 1;
+		for (int i = 0; i < (power < 0 ? -power : power); i++)
+			ret *= base;
+		return power < 0 ? 1 / ret : ret;
+	}
+
+	// Constant base and integer exponent, not dividing by zero.
+	template <typename L, typename R>
+	[[nodiscard]] constexpr bool IsIntegerPower() noexcept
+	{
+		if constexpr (is_value<L> and is_value<R>)
+			return R::value == static_cast<int>(R::value) and (L::value != 0 or R::value >= 0);
+		else
+			return false;
+	}
+
+	template <Expression L, Expression R>
+	[[nodiscard]] constexpr auto MakePow(L, R) noexcept
+	{
+		if constexpr (IsIntegerPower<L, R>())
+			return Value<IntegerPower(L::value, static_cast<int>(R::value))>{};
+		else if constexpr (Is<L>(0))
+			return Value<0.0f>{};
+		else if constexpr (Is<L>(1) or Is<R>(0))
+			return Value<1.0f>{};
+		else if constexpr (Is<R>(1))
+			return L{};
+		else
+			return Pow<L, R>{};
+	}
+
+	template <Expression N>
+	[[nodiscard]] constexpr auto MakeExp(N) noexcept
+	{
+		if constexpr (is_log<N>)
+			return typename N::operand{};
+		else
+			return Exp<N>{};
+	}
+
+	template <Expression N>
+	[[nodiscard]] constexpr auto MakeLog(N) noexcept
+	{
+		if constexpr (is_exp<N>)
+			return typename N::operand{};
+		else
+			return Log<N>{};
+	}
+
+	// Simplify
+
+	template <float V> [[nodiscard]] constexpr auto Simplify(Value<V> e) noexcept { return e; }
+	template <std::size_t I> [[nodiscard]] constexpr auto Simplify(Symbol<I> e) noexcept { return e; }
+	template <typename N> [[nodiscard]] constexpr auto Simplify(Neg<N>) noexcept { return MakeNeg(Simplify(N{})); }
+	template <typename L, typename R> [[nodiscard]] constexpr auto Simplify(Add<L, R>) noexcept { return MakeAdd(Simplify(L{}), Simplify(R{})); }
+	template <typename L, typename R> [[nodiscard]] constexpr auto Simplify(Sub<L, R>) noexcept { return MakeSub(Simplify(L{}), Simplify(R{})); }
+	template <typename L, typename R> [[nodiscard]] constexpr auto Simplify(Mul<L, R>) noexcept { return MakeMul(Simplify(L{}), Simplify(R{})); }
+	template <typename L, typename R> [[nodiscard]] constexpr auto Simplify(Div<L, R>) noexcept { return MakeDiv(Simplify(L{}), Simplify(R{})); }
+	template <typename L, typename R> [[nodiscard]] constexpr auto Simplify(Pow<L, R>) noexcept { return MakePow(Simplify(L{}), Simplify(R{})); }
+	template <typename N> [[nodiscard]] constexpr auto Simplify(Exp<N>) noexcept { return MakeExp(Simplify(N{})); }
+	template <typename N> [[nodiscard]] constexpr auto Simplify(Log<N>) noexcept { return MakeLog(Simplify(N{})); }
+
+	// Derive
+	// Same rules as the runtime 'Derive', followed by 'Simplify'.
+
+	template <std::size_t I, float V> [[nodiscard]] constexpr auto Derive(Value<V>) noexcept { return Value<0.0f>{}; }
+	template <std::size_t I, std::size_t J> [[nodiscard]] constexpr auto Derive(Symbol<J>) noexcept { return Value<I == J ? 1.0f : 0.0f>{}; }
+
+	template <std::size_t I, typename N>
+	[[nodiscard]] constexpr auto Derive(Neg<N>) noexcept
+	{
+		return MakeNeg(Derive<I>(N{}));
+	}
+
+	template <std::size_t I, typename L, typename R>
+	[[nodiscard]] constexpr auto Derive(Add<L, R>) noexcept
+	{
+		return MakeAdd(Derive<I>(L{}), Derive<I>(R{}));
+	}
+
+	template <std::size_t I, typename L, typename R>
+	[[nodiscard]] constexpr auto Derive(Sub<L, R>) noexcept
+	{
+		return MakeSub(Derive<I>(L{}), Derive<I>(R{}));
+	}
+
+	template <std::size_t I, typename L, typename R>
+	[[nodiscard]] constexpr auto Derive(Mul<L, R>) noexcept
+	{
+		return MakeAdd(
+			MakeMul(Derive<I>(L{}), Simplify(R{})),
+			MakeMul(Simplify(L{}), Derive<I>(R{})));
+	}
+
+	template <std::size_t I, typename L, typename R>
+	[[nodiscard]] constexpr auto Derive(Div<L, R>) noexcept
+	{
+		return MakeDiv(
+			MakeSub(
+				MakeMul(Derive<I>(L{}), Simplify(R{})),
+				MakeMul(Simplify(L{}), Derive<I>(R{}))),
+			MakeMul(Simplify(R{}), Simplify(R{})));
+	}
+
+	template <std::size_t I, typename L, typename R>
+	[[nodiscard]] constexpr auto Derive(Pow<L, R> e) noexcept
+	{
+		return MakeMul(
+			Simplify(e),
+			MakeAdd(
+				MakeMul(
+					Derive<I>(R{}),
+					MakeLog(Simplify(L{}))),
+				MakeMul(
+					Simplify(R{}),
+					MakeDiv(Derive<I>(L{}), Simplify(L{})))));
+	}
+
+	template <std::size_t I, typename N>
+	[[nodiscard]] constexpr auto Derive(Exp<N> e) noexcept
+	{
+		return MakeMul(Simplify(e), Derive<I>(N{}));
+	}
+
+	template <std::size_t I, typename N>
+	[[nodiscard]] constexpr auto Derive(Log<N>) noexcept
+	{
+		return MakeDiv(Derive<I>(N{}), Simplify(N{}));
+	}
+}
@@ -0,0 +1,199 @@
+#include "Stats.h"
+#include <atomic>
+#include <numeric>
+#include <utility>
+
+namespace
+{
+#ifdef SYMEXP_STATS
+	using Counter = std::atomic<std::uint64_t>;
+
+	struct Totals
+	{
+		std::array<Counter, Stats::op_count> created{}, destroyed{}, folded{}, flat_folded{};
+		Counter pool_allocations{}, pool_bytes{}, heap_allocations{};
+		std::array<Counter, Stats::pass_count> calls{}, nanoseconds{};
+	};
+
+	Totals& Global() noexcept
+	{
+		static Totals* totals = new Totals(); // never destroyed, nodes may be released during static destruction
+		return *totals;
+	}
+
+	std::atomic<Stats::TraceHook> trace_hook{ nullptr };
+	thread_local std::uint32_t pass_depth = 0;
+
+	void Add(Counter& counter, std::uint64_t n = 1) noexcept
+	{
+		counter.fetch_add(n, std::memory_order_relaxed);
+	}
+
+	template <std::size_t N>
+	std::array<std::uint64_t, N> Load(const std::array<Counter, N>& counters) noexcept
+	{
+		std::array<std::uint64_t, N> ret;
+		for (std::size_t i = 0; i < N; i++)
+			ret[i] = counters[i].load(std::memory_order_relaxed);
+		return ret;
+	}
+
+	template <std::size_t N>
+	void Clear(std::array<Counter, N>& counters) noexcept
+	{
+		for (auto& counter : counters)
+			counter.store(0, std::memory_order_relaxed);
+	}
+
+	std::uint64_t TotalCreated() noexcept
+	{
+		const auto created = Load(Global().created);
+		return std::accumulate(created.begin(), created.end(), std::uint64_t{ 0 });
+	}
+#endif
+}
+
+const char* Stats::Name(OpCode op) noexcept
+{
+	switch (op)
+	{
+		case OpCode::Value: return "Value";
+		case OpCode::Input: return "Symbol";
+		case OpCode::Neg: return "Neg";
+		case OpCode::Add: return "Add";
+		case OpCode::Sub: return "Sub";
+		case OpCode::Mul: return "Mul";
+		case OpCode::Div: return "Div";
+		case OpCode::Pow: return "Pow";
+		case OpCode::Exp: return "Exp";
+		case OpCode::Log: return "Log";
+	}
+	return "";
+}
+
+const char* Stats::Name(Pass pass) noexcept
+{
+	switch (pass)
+	{
+		case Pass::Derive: return "Derive";
+		case Pass::Gradient: return "Gradient";
+		case Pass::Simplify: return "Simplify";
+		case Pass::Eval: return "Eval";
+		case Pass::Write: return "Write";
+		case Pass::Parse: return "Parse";
+	}
+	return "";
+}
+
+#ifdef SYMEXP_STATS
+Stats::Counters Stats::Read() noexcept
+{
+	const Totals& totals = Global();
+	Counters ret;
+	ret.created = Load(totals.created);
+	ret.destroyed = Load(totals.destroyed);
+	ret.folded = Load(totals.folded);
+	ret.flat_folded = Load(totals.flat_folded);
+	ret.pool_allocations = totals.pool_allocations.load(std::memory_order_relaxed);
+	ret.pool_bytes = totals.pool_bytes.load(std::memory_order_relaxed);
+	ret.heap_allocations = totals.heap_allocations.load(std::memory_order_relaxed);
+	ret.calls = Load(totals.calls);
+	ret.nanoseconds = Load(totals.nanoseconds);
+	return ret;
+}
+
+void Stats::Reset() noexcept
+{
+	Totals& totals = Global();
+	Clear(totals.created);
+	Clear(totals.destroyed);
+	Clear(totals.folded);
+	Clear(totals.flat_folded);
+	totals.pool_allocations.store(0, std::memory_order_relaxed);
+	totals.pool_bytes.store(0, std::memory_order_relaxed);
+	totals.heap_allocations.store(0, std::memory_order_relaxed);
+	Clear(totals.calls);
+	Clear(totals.nanoseconds);
+}
+
+void Stats::SetTraceHook(TraceHook hook) noexcept
+{
+	trace_hook.store(hook, std::memory_order_release);
+}
+
+void Stats::Created(OpCode op) noexcept
+{
+	Add(Global().created[static_cast<std::size_t>(op)]);
+}
+
+void Stats::Destroyed(OpCode op) noexcept
+{
+	Add(Global().destroyed[static_cast<std::size_t>(op)]);
+}
+
+void Stats::Folded(OpCode op) noexcept
+{
+	Add(Global().folded[static_cast<std::size_t>(op)]);
+}
+
+void Stats::FlatFolded(OpCode op) noexcept
+{
+	Add(Global().flat_folded[static_cast<std::size_t>(op)]);
+}
+
+void Stats::Allocated(std::size_t bytes, bool pooled) noexcept
+{
+	Totals& totals = Global();
+	if (pooled)
+	{
+		Add(totals.pool_allocations);
+		Add(totals.pool_bytes, bytes);
+	}
+	else
+		Add(totals.heap_allocations);
+}
+
+Stats::Scope::Scope(Pass pass) noexcept
+	: pass(pass)
+	, outermost(pass_depth++ == 0)
+	, start(outermost ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{})
+	, created(outermost ? TotalCreated() : 0)
+{}
+
+Stats::Scope::~Scope()
+{
+	pass_depth--;
+	if (not outermost)
+		return;
+	const auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+	Totals& totals = Global();
+	Add(totals.calls[static_cast<std::size_t>(pass)]);
+	Add(totals.nanoseconds[static_cast<std::size_t>(pass)], static_cast<std::uint64_t>(duration.count()));
+	if (auto hook = trace_hook.load(std::memory_order_acquire))
+		hook({ pass, start, duration, TotalCreated() - created });
+}
+
+std::uint32_t Stats::Depth() noexcept
+{
+	return pass_depth;
+}
+
+Stats::Nested::Nested(std::uint32_t depth) noexcept : saved(std::exchange(pass_depth, pass_depth + depth))
+{}
+
+Stats::Nested::~Nested()
+{
+	pass_depth = saved;
+}
+#else
+Stats::Counters Stats::Read() noexcept
+{
+	return {};
+}
+
+void Stats::Reset() noexcept
+{}
+
+void Stats::SetTraceHook(TraceHook) noexcept
+{}
+#endif
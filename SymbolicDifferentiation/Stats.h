@@ -0,0 +1,121 @@
+#pragma once
+#include "CompiledExp.h"
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Counters of node creation, pool allocation, simplification and pass durations, for profiling expression growth.
+// Compiled in when SYMEXP_STATS is defined. Otherwise every hook is an empty inline function, 'Read' returns zeros
+// and the trace hook is never called.
+// Counters are process-wide and relaxed, under concurrency they add up the work of every thread.
+namespace Stats
+{
+#ifdef SYMEXP_STATS
+	constexpr bool enabled = true;
+#else
+	constexpr bool enabled = false;
+#endif
+
+	constexpr std::size_t op_count = static_cast<std::size_t>(OpCode::Log) + 1;
+
+	// Public entry points of SymExp that are timed.
+	enum class Pass : std::uint8_t
+	{
+		Derive, Gradient, Simplify, Eval, Write, Parse
+	};
+	constexpr std::size_t pass_count = static_cast<std::size_t>(Pass::Parse) + 1;
+
+	[[nodiscard]] const char* Name(OpCode) noexcept;
+	[[nodiscard]] const char* Name(Pass) noexcept;
+
+	struct Counters
+	{
+		// By node type, indexed by OpCode. Symbols are 'Input'.
+		std::array<std::uint64_t, op_count> created{}; // new distinct nodes, requests for an existing one are not counted
+		std::array<std::uint64_t, op_count> destroyed{};
+		std::array<std::uint64_t, op_count> folded{}; // simplification rules of the type that applied
+		std::array<std::uint64_t, op_count> flat_folded{}; // the same for FlatExp, which builds no nodes in the store
+
+		std::uint64_t pool_allocations = 0, pool_bytes = 0;
+		std::uint64_t heap_allocations = 0; // requests too large for the pool
+
+		// A pass called from another one, also from a task it runs on another thread, counts toward the outer pass only.
+		std::array<std::uint64_t, pass_count> calls{};
+		std::array<std::uint64_t, pass_count> nanoseconds{};
+	};
+
+	// Totals since the start or since the last 'Reset'.
+	[[nodiscard]] Counters Read() noexcept;
+	void Reset() noexcept;
+
+	// Sent when a pass ends, on the thread that ran it.
+	struct TraceEvent
+	{
+		Pass pass;
+		std::chrono::steady_clock::time_point start;
+		std::chrono::nanoseconds duration;
+		std::uint64_t created; // nodes created during the pass, by every thread
+	};
+	using TraceHook = void (*)(const TraceEvent&);
+
+	// Replaces the hook, null removes it.
+	void SetTraceHook(TraceHook) noexcept;
+
+#ifdef SYMEXP_STATS
+	void Created(OpCode) noexcept;
+	void Destroyed(OpCode) noexcept;
+	void Folded(OpCode) noexcept;
+	void FlatFolded(OpCode) noexcept;
+	void Allocated(std::size_t bytes, bool pooled) noexcept;
+
+	// Times a pass from construction to destruction.
+	class Scope
+	{
+		Pass pass;
+		bool outermost;
+		std::chrono::steady_clock::time_point start;
+		std::uint64_t created;
+	public:
+		explicit Scope(Pass) noexcept;
+		~Scope();
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+	};
+
+	// Passes running on this thread, to hand to 'Nested'.
+	[[nodiscard]] std::uint32_t Depth() noexcept;
+
+	// Marks a task that a pass runs on another thread as part of that pass, so the passes the task calls
+	// are not counted again. Constructed in the task with the 'Depth' of the thread that started it.
+	class Nested
+	{
+		std::uint32_t saved;
+	public:
+		explicit Nested(std::uint32_t depth) noexcept;
+		~Nested();
+		Nested(const Nested&) = delete;
+		Nested& operator=(const Nested&) = delete;
+	};
+#else
+	inline void Created(OpCode) noexcept {}
+	inline void Destroyed(OpCode) noexcept {}
+	inline void Folded(OpCode) noexcept {}
+	inline void FlatFolded(OpCode) noexcept {}
+	inline void Allocated(std::size_t, bool) noexcept {}
+
+	class Scope
+	{
+	public:
+		explicit Scope(Pass) noexcept {}
+	};
+
+	[[nodiscard]] inline std::uint32_t Depth() noexcept { return 0; }
+
+	class Nested
+	{
+	public:
+		explicit Nested(std::uint32_t) noexcept {}
+	};
+#endif
+}
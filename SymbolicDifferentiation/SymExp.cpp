@@ -1,112 +1,850 @@
 #include "SymExp.h"
+#include <array>
+#include <atomic>
+#include <charconv>
 #include <cassert>
+#include <cmath>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <mutex>
 #include <numeric>
+#include <shared_mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 
 using namespace AST;
 
-int Symbol::counter = 1;
+namespace
+{
+	// IDs come from an atomic counter, so creating an anonymous symbol takes no lock. Named symbols
+	// take the lock exclusively only the first time their name is seen.
+	class SymbolTable
+	{
+		std::shared_mutex mtx; // guards the maps, not the counter
+		std::atomic<std::uint32_t> counter{ 1 };
+		std::unordered_map<std::string, std::uint32_t> ids;
+		std::unordered_map<std::uint32_t, std::string> names;
+	public:
+		std::uint32_t Id(const std::string& name)
+		{
+			{
+				std::shared_lock lock(mtx);
+				if (auto it = ids.find(name); it != ids.end())
+					return it->second;
+			}
+			std::unique_lock lock(mtx);
+			auto [it, inserted] = ids.try_emplace(name, 0);
+			if (inserted)
+			{
+				it->second = NewId();
+				names.emplace(it->second, name);
+			}
+			return it->second;
+		}
+
+		std::uint32_t NewId() noexcept
+		{
+			return counter.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		// Anonymous symbols have no entry, their name is only built on request.
+		std::string Name(std::uint32_t id)
+		{
+			std::shared_lock lock(mtx);
+			auto it = names.find(id);
+			return it == names.end() ? '$' + std::to_string(id) : it->second;
+		}
+
+		bool Named(std::uint32_t id)
+		{
+			std::shared_lock lock(mtx);
+			return names.contains(id);
+		}
+	};
+
+	SymbolTable& Symbols()
+	{
+		static SymbolTable* table = new SymbolTable();
+		return *table;
+	}
+
+	struct NodeHash
+	{
+		std::size_t operator()(const Node* n) const noexcept { return n->hash(); }
+	};
+
+	struct NodeEqual
+	{
+		bool operator()(const Node* l, const Node* r) const noexcept { return l == r or l->Equal(*r); }
+	};
+
+	// Holds every live node once. Entries are removed by the deleter of their owning shared_ptr.
+	// Split by hash into shards with a lock each, so threads building expressions rarely wait on each other.
+	class NodeStore
+	{
+		struct alignas(64) Shard
+		{
+			std::mutex mtx;
+			std::unordered_set<const Node*, NodeHash, NodeEqual> nodes;
+		};
+		static constexpr std::size_t shard_count = 64; // the top 6 bits of the mixed hash
+
+		std::array<Shard, shard_count> shards;
+		std::atomic<std::size_t> count{ 0 }, peak{ 0 };
+
+		[[nodiscard]] Shard& ShardOf(const Node& n) noexcept
+		{
+			// Mixed first, symbol hashes are small integers. The high bits are used, the low ones pick the bucket within the shard.
+			return shards[(std::uint64_t{ n.hash() } * 0x9E3779B97F4A7C15) >> 58];
+		}
+	public:
+		NodePtr Intern(const Node& candidate)
+		{
+			Shard& shard = ShardOf(candidate);
+			std::unique_lock lock(shard.mtx);
+			auto it = shard.nodes.find(&candidate);
+			if (it != shard.nodes.end())
+			{
+				if (auto existing = (*it)->weak_from_this().lock())
+					return existing;
+				shard.nodes.erase(it); // expired, its deleter is about to run
+				count.fetch_sub(1, std::memory_order_relaxed);
+			}
+			NodePtr node(candidate.Clone().release(), [this](const Node* n) { Release(n); }, PoolAllocator<Node>{});
+			Stats::Created(candidate.op());
+			shard.nodes.insert(node.get());
+			lock.unlock();
+			const std::size_t now = count.fetch_add(1, std::memory_order_relaxed) + 1;
+			std::size_t high = peak.load(std::memory_order_relaxed);
+			while (now > high and not peak.compare_exchange_weak(high, now, std::memory_order_relaxed))
+				;
+			return node;
+		}
+
+		void Release(const Node* n)
+		{
+			Stats::Destroyed(n->op());
+			{
+				Shard& shard = ShardOf(*n);
+				std::unique_lock lock(shard.mtx);
+				auto it = shard.nodes.find(n);
+				if (it != shard.nodes.end() and *it == n)
+				{
+					shard.nodes.erase(it);
+					count.fetch_sub(1, std::memory_order_relaxed);
+				}
+			}
+
+			// Deleting a node releases its children, which may be released in turn. Those are queued
+			// and deleted by the outermost release, so freeing a long chain does not recurse.
+			thread_local std::vector<const Node*>* pending = nullptr;
+			if (pending)
+			{
+				pending->push_back(n);
+				return;
+			}
+			std::vector<const Node*> queue;
+			pending = &queue;
+			delete n;
+			while (not queue.empty())
+			{
+				const Node* next = queue.back();
+				queue.pop_back();
+				delete next;
+			}
+			pending = nullptr;
+		}
+
+		std::size_t size() const noexcept
+		{
+			return count.load(std::memory_order_relaxed);
+		}
+
+		std::size_t Peak(bool reset) noexcept
+		{
+			return reset ? peak.exchange(size(), std::memory_order_relaxed) : peak.load(std::memory_order_relaxed);
+		}
+	};
+
+	NodeStore& Store()
+	{
+		static NodeStore* store = new NodeStore(); // never destroyed, nodes may outlive static destruction
+		return *store;
+	}
+
+	// Number of users of each node in 'order', counting a node used twice by the same user twice.
+	std::unordered_map<const Node*, std::size_t> Uses(const std::vector<const Node*>& order)
+	{
+		std::unordered_map<const Node*, std::size_t> uses;
+		for (const Node* node : order)
+			for (std::size_t i = 0; i < node->arity(); i++)
+				uses[node->operand(i).get()]++;
+		return uses;
+	}
+
+	void WriteShared(const Node& root, Writer& out)
+	{
+		auto order = Postorder(root);
+		auto uses = Uses(order);
+		std::size_t temporaries = 0;
+		for (const Node* node : order)
+			if (node->arity() > 0 and uses[node] > 1)
+			{
+				auto name = "$t" + std::to_string(temporaries++);
+				out << name << " = " << *node << "\n";
+				out.Name(*node, std::move(name));
+			}
+		out << root;
+	}
+
+	// Canonical operand order of sums and products, by structural hash and then by identity.
+	[[nodiscard]] bool TermBefore(const Node& l, const Node& r) noexcept
+	{
+		if (l.hash() != r.hash())
+			return l.hash() < r.hash();
+		return std::less<>{}(&l, &r);
+	}
+
+	// Number of operands of a sum or product 'T' after flattening.
+	template <typename T>
+	[[nodiscard]] std::size_t FlatSize(const Terms& terms) noexcept
+	{
+		std::size_t size = 0;
+		for (const auto& term : terms)
+		{
+			auto nested = dynamic_cast<const T*>(term.get());
+			size += nested and nested->operands().size() < flatten_limit ? nested->operands().size() : 1;
+		}
+		return size;
+	}
+
+	// A term of a sum as 'coefficient * factors', where 'factors' are the operands of a product without its constant.
+	struct Monomial
+	{
+		float coefficient;
+		const NodePtr* factors;
+		std::size_t count;
+		std::size_t hash;
+		const NodePtr* term;
+	};
+
+	Monomial MakeMonomial(const NodePtr& term)
+	{
+		Monomial ret{ 1, &term, 1, 0, &term };
+		const Node* node = term.get();
+		if (auto neg = dynamic_cast<const Neg*>(node))
+		{
+			ret.coefficient = -1;
+			ret.factors = &neg->operand(0);
+			node = ret.factors->get();
+		}
+		if (auto mul = dynamic_cast<const Mul*>(node))
+		{
+			const Terms& factors = mul->operands();
+			const bool scaled = factors.front()->has_value();
+			ret.coefficient *= scaled ? factors.front()->value() : 1;
+			ret.factors = factors.data() + scaled;
+			ret.count = factors.size() - scaled;
+		}
+		ret.hash = ret.factors[0]->hash();
+		for (std::size_t i = 1; i < ret.count; i++)
+			ret.hash = HashCombine(ret.hash, ret.factors[i]->hash());
+		return ret;
+	}
+
+	[[nodiscard]] bool SameFactors(const Monomial& l, const Monomial& r) noexcept
+	{
+		return l.hash == r.hash and std::equal(l.factors, l.factors + l.count, r.factors, r.factors + r.count);
+	}
+
+	// Orders by hash, ties by factor identity, so equal factor lists are adjacent.
+	[[nodiscard]] bool FactorsBefore(const Monomial& l, const Monomial& r) noexcept
+	{
+		if (l.hash != r.hash)
+			return l.hash < r.hash;
+		return std::lexicographical_compare(l.factors, l.factors + l.count, r.factors, r.factors + r.count,
+			[](const NodePtr& a, const NodePtr& b) { return TermBefore(*a, *b); });
+	}
+
+	// A factor of a product as 'pow(base, exponent)'.
+	struct Power
+	{
+		const NodePtr* base;
+		float exponent;
+		const NodePtr* factor;
+	};
+
+	[[nodiscard]] bool BaseBefore(const Power& l, const Power& r) noexcept
+	{
+		return TermBefore(**l.base, **r.base);
+	}
+}
 
-SymExp::SymExp(float value) noexcept : root(std::make_unique<Value>(value))
-{}
+std::uint32_t AST::SymbolId(const std::string& name)
+{
+	return Symbols().Id(name);
+}
 
-SymExp::SymExp(std::string name) noexcept : root(std::make_unique<Symbol>(std::move(name)))
-{}
+std::uint32_t AST::NewSymbolId()
+{
+	return Symbols().NewId();
+}
 
-SymExp::SymExp(const SymExp& o) noexcept : root(o.root->Clone())
-{}
+std::string AST::SymbolName(std::uint32_t id)
+{
+	return Symbols().Name(id);
+}
+
+bool AST::SymbolNamed(std::uint32_t id)
+{
+	return Symbols().Named(id);
+}
+
+NodePtr AST::SymbolNode(std::uint32_t id)
+{
+	// Named symbols hash their name, so they are found through it.
+	if (Symbols().Named(id))
+		return Make<Symbol>(SymbolName(id));
+	return Make<Symbol>(id);
+}
 
-SymExp& SymExp::operator=(const SymExp& o) noexcept
+NodePtr AST::Intern(const Node& candidate)
 {
-	root = o.root->Clone();
+	return Store().Intern(candidate);
+}
+
+std::size_t AST::NodeCount()
+{
+	return Store().size();
+}
+
+std::size_t AST::PeakNodeCount(bool reset)
+{
+	return Store().Peak(reset);
+}
+
+std::vector<const Node*> AST::Postorder(const Node& root)
+{
+	std::vector<const Node*> order;
+	std::unordered_set<const Node*> visited;
+	Traverse(root,
+		[&visited](const Node* node) { return visited.insert(node).second; },
+		[&order](const Node* node) { order.push_back(node); });
+	return order;
+}
+
+SymbolSet::SymbolSet(std::uint32_t id)
+{
+	if (id < mask_ids)
+		mask = std::uint64_t{ 1 } << id;
+	else
+	{
+		mask = listed;
+		ids = std::make_shared<const std::vector<std::uint32_t>>(1, id);
+	}
+}
+
+bool SymbolSet::intersects(const SymbolSet& o) const noexcept
+{
+	if (mask & o.mask & ~listed)
+		return true;
+	if (not ids or not o.ids)
+		return false;
+	if (ids == o.ids)
+		return true;
+	auto i = ids->begin(), j = o.ids->begin();
+	while (i != ids->end() and j != o.ids->end())
+	{
+		if (*i == *j)
+			return true;
+		*i < *j ? ++i : ++j;
+	}
+	return false;
+}
+
+// The union keeps the list of either operand when it already holds every higher ID.
+SymbolSet& SymbolSet::operator|=(const SymbolSet& o)
+{
+	mask |= o.mask;
+	if (not o.ids or ids == o.ids)
+		return *this;
+	if (not ids)
+	{
+		ids = o.ids;
+		return *this;
+	}
+	std::vector<std::uint32_t> both;
+	both.reserve(ids->size() + o.ids->size());
+	std::set_union(ids->begin(), ids->end(), o.ids->begin(), o.ids->end(), std::back_inserter(both));
+	if (both.size() == o.ids->size())
+		ids = o.ids;
+	else if (both.size() != ids->size())
+		ids = std::make_shared<const std::vector<std::uint32_t>>(std::move(both));
+	return *this;
+}
+
+void Writer::Name(const Node& node, std::string name)
+{
+	names.insert_or_assign(&node, std::move(name));
+}
+
+void Writer::Put(std::string_view text)
+{
+	if (buffer)
+		buffer->append(text);
+	else
+		stream->write(text.data(), static_cast<std::streamsize>(text.size()));
+}
+
+void Writer::Put(float value)
+{
+	// Same format as std::to_string.
+	char text[64];
+	auto [end, ec] = std::to_chars(text, text + sizeof(text), value, std::chars_format::fixed, 6);
+	Put(std::string_view(text, end - text));
+}
+
+const std::string* Writer::Find(const Node& node) const
+{
+	if (names.empty())
+		return nullptr;
+	auto it = names.find(&node);
+	return it == names.end() ? nullptr : &it->second;
+}
+
+// Text ahead of the first queued operand is written at once, everything after it is queued in order.
+Writer& Writer::operator<<(std::string_view text)
+{
+	if (parts and parts->size() > first)
+		parts->push_back(text);
+	else
+		Put(text);
+	return *this;
+}
+
+Writer& Writer::operator<<(float value)
+{
+	if (parts and parts->size() > first)
+		parts->push_back(value);
+	else
+		Put(value);
+	return *this;
+}
+
+Writer& Writer::operator<<(const Node& node)
+{
+	if (parts)
+	{
+		// Leaves only write text, so one with nothing queued ahead of it is written in place.
+		if (parts->size() == first and node.arity() == 0 and not Find(node))
+			node.Write(*this);
+		else
+			parts->push_back(&node);
+		return *this;
+	}
+	if (auto name = Find(node))
+	{
+		Put(*name);
+		return *this;
+	}
+	if (depth < max_depth)
+	{
+		depth++;
+		node.Write(*this);
+		depth--;
+		return *this;
+	}
+
+	// The expansion of each node is queued on top of the stack and reversed, so it is popped in order.
+	std::vector<Part> stack{ &node };
+	parts = &stack;
+	while (not stack.empty())
+	{
+		Part part = stack.back();
+		stack.pop_back();
+		if (auto text = std::get_if<std::string_view>(&part))
+			Put(*text);
+		else if (auto value = std::get_if<float>(&part))
+			Put(*value);
+		else if (auto next = std::get<const Node*>(part); auto name = Find(*next))
+			Put(*name);
+		else
+		{
+			first = stack.size();
+			next->Write(*this);
+			std::reverse(stack.begin() + first, stack.end());
+		}
+	}
+	parts = nullptr;
+	first = 0;
 	return *this;
 }
 
+NodePtr Node::Simplify() const
+{
+	if (simplified.load(std::memory_order_relaxed))
+		return shared_from_this();
+
+	// Rewrites each distinct node on top of its already simplified operands, skipping simplified subtrees.
+	NodeMap<NodePtr> memo;
+	auto done = [&memo](const Node* node) {
+		return node->simplified.load(std::memory_order_relaxed) or memo.contains(node);
+	};
+	std::vector<NodePtr> operands;
+	Traverse(*this, std::not_fn(done), [&memo, &operands](const Node* node) {
+		operands.resize(node->arity());
+		for (std::size_t i = 0; i < node->arity(); i++)
+		{
+			const NodePtr& operand = node->operand(i);
+			operands[i] = operand->simplified.load(std::memory_order_relaxed) ? operand : memo.at(operand.get());
+		}
+		NodePtr ret = node->Rewrite(operands.data());
+		ret->simplified.store(true, std::memory_order_relaxed);
+		memo.emplace(node, std::move(ret));
+	});
+	return memo.at(this);
+}
+
+std::string Node::to_string() const
+{
+	std::string ret;
+	Writer out(ret);
+	out << *this;
+	return ret;
+}
+
+void Adjoints::Add(const NodePtr& node, NodePtr contribution)
+{
+	auto [it, inserted] = map.try_emplace(node.get(), contribution);
+	if (not inserted)
+		it->second = Make<AST::Add>(std::move(it->second), std::move(contribution));
+}
+
+NodePtr Adjoints::operator[](const Node* node) const
+{
+	auto it = map.find(node);
+	return it == map.end() ? nullptr : it->second;
+}
+
+void Bindings::Bind(const Symbol& s, float value)
+{
+	values.try_emplace(&s, value);
+	bound |= s.symbols();
+}
+
+const float* Bindings::Find(const Symbol& s) const
+{
+	auto it = values.find(&s);
+	return it == values.end() ? nullptr : &it->second;
+}
+
+// Nodes evaluate their operands through this again, which the traversal has already memoized.
+NodePtr Bindings::Eval(const Node& node)
+{
+	if (not node.symbols().intersects(bound))
+		return node.shared_from_this();
+	auto it = memo.find(&node);
+	if (it != memo.end())
+		return it->second;
+	Traverse(node,
+		[this](const Node* n) { return n->symbols().intersects(bound) and not memo.contains(n); },
+		[this](const Node* n) { memo.emplace(n, Substitute(*n)); });
+	return memo.at(&node);
+}
+
+// Rewriting a node over simplified operands simplifies it, as in 'Simplify'. Any other node is rebuilt,
+// so no node is marked simplified over an operand that is not.
+NodePtr Bindings::Substitute(const Node& node)
+{
+	if (node.arity() == 0)
+		return node.Eval(*this);
+	bool simplified = true;
+	operands.resize(node.arity());
+	for (std::size_t i = 0; i < node.arity(); i++)
+	{
+		const NodePtr& operand = node.operand(i);
+		operands[i] = operand->symbols().intersects(bound) ? memo.at(operand.get()) : operand;
+		simplified = simplified and (operands[i]->arity() == 0 or operands[i]->simplified.load(std::memory_order_relaxed));
+	}
+	if (not simplified)
+		return node.Rebuild(operands.data());
+	NodePtr ret = node.Rewrite(operands.data());
+	ret->simplified.store(true, std::memory_order_relaxed);
+	return ret;
+}
+
+NodePtr Derivatives::Derive(const Node& node)
+{
+	if (not node.mentions(symbol))
+		return Make<Value>(0);
+	auto it = memo.find(&node);
+	if (it != memo.end())
+		return it->second;
+	Traverse(node,
+		[this](const Node* n) { return n->mentions(symbol) and not memo.contains(n); },
+		[this](const Node* n) { memo.emplace(n, n->Derive(*this)); });
+	return memo.at(&node);
+}
+
+SymExp::SymExp(float value) noexcept : root(Make<Value>(value))
+{}
+
+SymExp::SymExp(std::string name) noexcept : root(Make<Symbol>(std::move(name)))
+{}
+
 SymExp operator-(SymExp o)
 {
-	return SymExp{ std::make_unique<Neg>(std::move(o.root)) };
+	return SymExp{ Make<Neg>(std::move(o.root)) };
 }
 
 SymExp operator+(SymExp l, SymExp r)
 {
-	return SymExp{ std::make_unique<Add>(std::move(l.root), std::move(r.root)) };
+	return SymExp{ Make<Add>(std::move(l.root), std::move(r.root)) };
 }
 
 SymExp operator-(SymExp l, SymExp r)
 {
-	return SymExp{ std::make_unique<Sub>(std::move(l.root), std::move(r.root)) };
+	return SymExp{ Make<Sub>(std::move(l.root), std::move(r.root)) };
 }
 
 SymExp operator*(SymExp l, SymExp r)
 {
-	return SymExp{ std::make_unique<Mul>(std::move(l.root), std::move(r.root)) };
+	return SymExp{ Make<Mul>(std::move(l.root), std::move(r.root)) };
 }
 
 SymExp operator/(SymExp l, SymExp r)
 {
-	return SymExp{ std::make_unique<Div>(std::move(l.root), std::move(r.root)) };
+	return SymExp{ Make<Div>(std::move(l.root), std::move(r.root)) };
 }
 
 SymExp pow(SymExp l, SymExp r)
 {
-	return SymExp{ std::make_unique<Pow>(std::move(l.root), std::move(r.root)) };
+	return SymExp{ Make<Pow>(std::move(l.root), std::move(r.root)) };
 }
 
 SymExp exp(SymExp s)
 {
-	return SymExp{ std::make_unique<Exp>(std::move(s.root)) };
+	return SymExp{ Make<Exp>(std::move(s.root)) };
 }
 
 SymExp log(SymExp s)
 {
-	return SymExp{ std::make_unique<Log>(std::move(s.root)) };
+	return SymExp{ Make<Log>(std::move(s.root)) };
+}
+
+Bindings SymExp::Bind(const std::vector<Var>& vars, const std::vector<float>& values)
+{
+	assert(vars.size() == values.size());
+	Bindings bindings;
+	for (std::size_t i = 0; i < vars.size(); i++)
+		bindings.Bind(static_cast<const Symbol&>(*vars[i].root), values[i]);
+	return bindings;
+}
+
+SymExp SymExp::At(Bindings& bindings) const
+{
+	Stats::Scope scope(Stats::Pass::Eval);
+	return SymExp{ bindings.Eval(*root)->Simplify() };
 }
 
 SymExp SymExp::At(const Var& var, float value) const
 {
-	return SymExp{ root->Eval(static_cast<Symbol&>(*var.root), value)->Simplify() };
+	Bindings bindings;
+	bindings.Bind(static_cast<const Symbol&>(*var.root), value);
+	return At(bindings);
 }
 
 SymExp SymExp::At(const std::vector<Var>& vars, const std::vector<float>& values) const
 {
-	assert(vars.size() == values.size());
-	SymExp tmp = *this;
-	for (std::size_t i = 0; i <vars.size(); i++)
-		tmp = tmp.At(vars[i], values[i]);
-	return tmp;
+	auto bindings = Bind(vars, values);
+	return At(bindings);
+}
+
+SymExp SymExp::PartialAt(const Var& var, float value) const
+{
+	Stats::Scope scope(Stats::Pass::Eval);
+	Bindings bindings;
+	bindings.Bind(static_cast<const Symbol&>(*var.root), value);
+	return SymExp{ bindings.Eval(*root) };
+}
+
+SymExp SymExp::PartialAt(const std::vector<Var>& vars, const std::vector<float>& values) const
+{
+	Stats::Scope scope(Stats::Pass::Eval);
+	auto bindings = Bind(vars, values);
+	return SymExp{ bindings.Eval(*root) };
 }
 
 SymExp SymExp::Derive(const Var& var) const
 {
-	return SymExp{ root->Derive(static_cast<Symbol&>(*var.root))->Simplify() };
+	Stats::Scope scope(Stats::Pass::Derive);
+	// Deriving a simplified tree keeps every operand lookup in Derive constant time.
+	Derivatives derivatives(static_cast<const Symbol&>(*var.root));
+	return SymExp{ derivatives.Derive(*root->Simplify()) };
 }
 
 SymExpVec SymExp::Derive(const std::vector<Var>& vars) const
 {
-	std::vector<SymExp> ret;
-	for (const auto& var : vars)
-		ret.push_back(Derive(var));
-	return ret;
+	return Gradient(vars);
 }
 
 SymExpVec SymExp::DeriveAt(const std::vector<Var>& vars, const std::vector<float>& values) const
 {
 	assert(vars.size() == values.size());
+	return Gradient(vars).At(vars, values);
+}
+
+std::vector<SymExp> SymExp::Adjoints(const std::vector<Var>& vars) const
+{
+	auto order = Postorder(*root);
+	AST::Adjoints adjoints;
+	adjoints.Add(root, Make<Value>(1));
+	for (auto it = order.rbegin(); it != order.rend(); ++it)
+		if (auto adjoint = adjoints[*it])
+			(*it)->Adjoin(adjoint, adjoints);
+
 	std::vector<SymExp> ret;
-	for (std::size_t i = 0; i < vars.size(); i++)
-		ret.push_back(Derive(vars[i]).At(vars, values));
+	ret.reserve(vars.size());
+	for (const auto& var : vars)
+	{
+		auto adjoint = adjoints[var.root.get()];
+		ret.push_back(SymExp{ adjoint ? adjoint : Make<Value>(0) });
+	}
+	return ret;
+}
+
+SymExpVec SymExp::Gradient(const std::vector<Var>& vars) const
+{
+	Stats::Scope scope(Stats::Pass::Gradient);
+	std::vector<SymExp> ret = Adjoints(vars);
+	for (auto& e : ret)
+		e = std::move(e).Simplify();
 	return ret;
 }
 
-SymExp SymExp::Simplify() const
+std::vector<float> SymExp::GradientAt(const std::vector<Var>& vars, const std::vector<float>& values) const
+{
+	assert(vars.size() == values.size());
+	return Compile(vars).Gradient(values);
+}
+
+SymExp SymExp::Simplify() const&
 {
+	Stats::Scope scope(Stats::Pass::Simplify);
 	return SymExp{ root->Simplify() };
 }
 
+SymExp SymExp::Simplify() &&
+{
+	Stats::Scope scope(Stats::Pass::Simplify);
+	root = root->Simplify();
+	return std::move(*this);
+}
+
 std::string SymExp::to_string() const
 {
+	Stats::Scope scope(Stats::Pass::Write);
 	return root->to_string();
 }
 
+void SymExp::Write(std::string& buffer) const
+{
+	Stats::Scope scope(Stats::Pass::Write);
+	Writer out(buffer);
+	out << *root;
+}
+
+void SymExp::Write(std::ostream& stream) const
+{
+	Stats::Scope scope(Stats::Pass::Write);
+	Writer out(stream);
+	out << *root;
+}
+
+void SymExp::WriteShared(std::string& buffer) const
+{
+	Stats::Scope scope(Stats::Pass::Write);
+	Writer out(buffer);
+	::WriteShared(*root, out);
+}
+
+void SymExp::WriteShared(std::ostream& stream) const
+{
+	Stats::Scope scope(Stats::Pass::Write);
+	Writer out(stream);
+	::WriteShared(*root, out);
+}
+
+LetSequence SymExp::CSE() const
+{
+	auto order = Postorder(*root);
+	auto uses = Uses(order);
+
+	// Rebuilds every node on top of the already replaced operands.
+	std::unordered_map<const Node*, NodePtr> replaced;
+	std::vector<std::pair<Var, SymExp>> temporaries;
+	std::vector<NodePtr> operands;
+	for (const Node* node : order)
+	{
+		operands.resize(node->arity());
+		for (std::size_t i = 0; i < node->arity(); i++)
+			operands[i] = replaced[node->operand(i).get()];
+		NodePtr rebuilt = node->Rebuild(operands.data());
+
+		if (node->arity() > 0 and uses[node] > 1)
+		{
+			Var tmp;
+			replaced.emplace(node, tmp.root);
+			temporaries.emplace_back(std::move(tmp), SymExp{ std::move(rebuilt) });
+		}
+		else
+			replaced.emplace(node, std::move(rebuilt));
+	}
+	return { std::move(temporaries), SymExp{ replaced[root.get()] } };
+}
+
+Tape SymExp::Lower(const std::vector<Var>& vars)
+{
+	std::vector<const Symbol*> symbols;
+	symbols.reserve(vars.size());
+	for (const auto& var : vars)
+		symbols.push_back(&static_cast<const Symbol&>(*var.root));
+	return Tape{ symbols };
+}
+
+std::vector<Var> SymExp::free_variables() const
+{
+	std::vector<Var> ret;
+	for (const Node* node : Postorder(*root))
+		if (auto symbol = dynamic_cast<const Symbol*>(node))
+			ret.push_back(Var{ symbol->shared_from_this() });
+	std::sort(ret.begin(), ret.end(), [](const Var& a, const Var& b) {
+		return static_cast<const Symbol&>(*a.root).id() < static_cast<const Symbol&>(*b.root).id();
+	});
+	return ret;
+}
+
+CompiledExp SymExp::Compile(const std::vector<Var>& vars) const
+{
+	Tape tape = Lower(vars);
+	tape.Compile(*root);
+	return CompiledExp{ std::move(tape) };
+}
+
+CodeGen SymExp::Generate(const std::vector<Var>& vars) const
+{
+	Tape tape = Lower(vars);
+	auto result = tape.Compile(*root);
+	return CodeGen{ std::move(tape), result };
+}
+
+void SymExp::EvaluateBatch(const std::vector<Var>& vars, const float* inputs, std::size_t n, float* out) const
+{
+	Compile(vars).Batch(inputs, n, out);
+}
+
 bool SymExp::has_value() const
 {
 	return root->has_value();
@@ -117,23 +855,79 @@ float SymExp::value() const
 	return root->value();
 }
 
+std::size_t SymExp::hash() const noexcept
+{
+	return root->hash();
+}
+
+std::size_t SymExp::node_count() const
+{
+	return Postorder(*root).size();
+}
+
+std::size_t SymExp::depth() const
+{
+	NodeMap<std::size_t> depths;
+	Traverse(*root,
+		[&depths](const Node* node) { return not depths.contains(node); },
+		[&depths](const Node* node) {
+			std::size_t below = 0;
+			for (std::size_t i = 0; i < node->arity(); i++)
+				below = std::max(below, depths.at(node->operand(i).get()));
+			depths.emplace(node, below + 1);
+		});
+	return depths.at(root.get());
+}
+
 
 SymExpVec SymExpVec::At(const Var& var, float value) const
 {
+	return At(std::vector<Var>{ var }, { value });
+}
+
+SymExpVec SymExpVec::At(const std::vector<Var>& vars, const std::vector<float>& values) const
+{
+	// One binding environment for all elements, so subexpressions they share are substituted once.
+	auto bindings = SymExp::Bind(vars, values);
 	std::vector<SymExp> ret;
 	ret.reserve(vec.size());
 	for (const auto& v : vec)
-		ret.push_back(v.At(var, value));
+		ret.push_back(v.At(bindings));
 	return { ret };
 }
 
-SymExpVec SymExpVec::At(const std::vector<Var>& vars, const std::vector<float>& values) const
+std::string LetSequence::to_string() const
 {
-	std::vector<SymExp> ret;
+	std::string ret;
+	for (const auto& [var, value] : temporaries)
+	{
+		var.Write(ret);
+		ret += " = ";
+		value.Write(ret);
+		ret += '\n';
+	}
+	result.Write(ret);
+	return ret;
+}
+
+
+std::vector<SymExpVec> SymExpVec::Derive(const std::vector<Var>& vars) const
+{
+	std::vector<SymExpVec> ret;
 	ret.reserve(vec.size());
 	for (const auto& v : vec)
-		ret.push_back(v.At(vars, values));
-	return { ret };
+		ret.push_back(v.Derive(vars));
+	return ret;
+}
+
+CodeGen SymExpVec::Generate(const std::vector<Var>& vars) const
+{
+	Tape tape = SymExp::Lower(vars);
+	std::vector<std::uint32_t> results;
+	results.reserve(vec.size());
+	for (const auto& v : vec)
+		results.push_back(tape.Compile(*v.root));
+	return CodeGen{ std::move(tape), std::move(results) };
 }
 
 std::vector<float> SymExpVec::value() const
@@ -146,227 +940,591 @@ std::vector<float> SymExpVec::value() const
 }
 
 
-Var::Var() noexcept : SymExp(std::make_unique<Symbol>())
+Var::Var() noexcept : SymExp(Make<Symbol>())
 {}
 
-Var::Var(std::string name) noexcept : SymExp(std::make_unique<Symbol>(std::move(name)))
+Var::Var(std::string name) noexcept : SymExp(Make<Symbol>(std::move(name)))
 {}
 
-Var::Var(float value) noexcept : SymExp(std::make_unique<Value>(value))
+Var::Var(float value) noexcept : SymExp(Make<Value>(value))
 {}
 
 
 
-std::unique_ptr<Node> Neg::Eval(const Symbol& s, float value) const
+NodePtr Symbol::Eval(Bindings& b) const
+{
+	auto value = b.Find(*this);
+	return value ? Make<Value>(*value) : shared_from_this();
+}
+
+
+
+NodePtr Neg::Derive(Derivatives& d) const
 {
-	return std::make_unique<Neg>(node->Eval(s, value));
+	return MakeSimplified<Neg>(d.Derive(*node));
 }
 
-std::unique_ptr<Node> Add::Eval(const Symbol& s, float value) const
+NodePtr Add::Derive(Derivatives& d) const
 {
-	return std::make_unique<Add>(l->Eval(s, value), r->Eval(s, value));
+	if (terms.size() == 2)
+		return MakeSimplified<Add>(d.Derive(*terms[0]), d.Derive(*terms[1]));
+	Terms ret;
+	ret.reserve(terms.size());
+	for (const auto& term : terms)
+		ret.push_back(d.Derive(*term));
+	return MakeSimplified<Add>(std::move(ret));
 }
 
-std::unique_ptr<Node> Sub::Eval(const Symbol& s, float value) const
+NodePtr Sub::Derive(Derivatives& d) const
 {
-	return std::make_unique<Sub>(l->Eval(s, value), r->Eval(s, value));
+	return MakeSimplified<Sub>(d.Derive(*l), d.Derive(*r));
 }
 
-std::unique_ptr<Node> Mul::Eval(const Symbol& s, float value) const
+NodePtr Mul::Derive(Derivatives& d) const
 {
-	return std::make_unique<Mul>(l->Eval(s, value), r->Eval(s, value));
+	if (terms.size() == 2)
+	{
+		const NodePtr& l = terms[0];
+		const NodePtr& r = terms[1];
+		return MakeSimplified<Add>(
+			MakeSimplified<Mul>(d.Derive(*l), r->Simplify()),
+			MakeSimplified<Mul>(l->Simplify(), d.Derive(*r)));
+	}
+
+	// Product rule, one term per factor that mentions the symbol.
+	Terms ret;
+	for (std::size_t i = 0; i < terms.size(); i++)
+	{
+		if (not terms[i]->mentions(d.variable()))
+			continue;
+		Terms product;
+		product.reserve(terms.size());
+		for (std::size_t j = 0; j < terms.size(); j++)
+			product.push_back(i == j ? d.Derive(*terms[j]) : terms[j]->Simplify());
+		ret.push_back(MakeSimplified<Mul>(std::move(product)));
+	}
+	return MakeSimplified<Add>(std::move(ret));
 }
 
-std::unique_ptr<Node> Div::Eval(const Symbol& s, float value) const
+NodePtr Div::Derive(Derivatives& d) const
 {
-	return std::make_unique<Div>(l->Eval(s, value), r->Eval(s, value));
+	auto L = l->Simplify();
+	auto R = r->Simplify();
+	return MakeSimplified<Div>(
+		MakeSimplified<Sub>(
+			MakeSimplified<Mul>(d.Derive(*l), R),
+			MakeSimplified<Mul>(L, d.Derive(*r))),
+		MakeSimplified<Mul>(R, R));
 }
 
-std::unique_ptr<Node> Pow::Eval(const Symbol& s, float value) const
+NodePtr Pow::Derive(Derivatives& d) const
 {
-	return std::make_unique<Pow>(l->Eval(s, value), r->Eval(s, value));
+	auto L = l->Simplify();
+	auto R = r->Simplify();
+	if (R->has_value())
+		return MakeSimplified<Mul>(Terms{
+			R,
+			MakeSimplified<Pow>(L, Make<Value>(R->value() - 1)),
+			d.Derive(*l) });
+	return MakeSimplified<Mul>(
+		Simplify(),
+		MakeSimplified<Add>(
+			MakeSimplified<Mul>(
+				d.Derive(*r),
+				MakeSimplified<Log>(L)),
+			MakeSimplified<Mul>(
+				R,
+				MakeSimplified<Div>(
+					d.Derive(*l),
+					L))
+			));
 }
 
-std::unique_ptr<Node> Exp::Eval(const Symbol& s, float value) const
+NodePtr Exp::Derive(Derivatives& d) const
 {
-	return std::make_unique<Exp>(node->Eval(s, value));
+	return MakeSimplified<Mul>(Simplify(), d.Derive(*node));
 }
 
-std::unique_ptr<Node> Log::Eval(const Symbol& s, float value) const
+NodePtr Log::Derive(Derivatives& d) const
 {
-	return std::make_unique<Log>(node->Eval(s, value));
+	return MakeSimplified<Div>(d.Derive(*node), node->Simplify());
 }
 
 
 
-std::unique_ptr<Node> Neg::Derive(const Symbol& s) const
+void Add::Write(Writer& out) const
 {
-	return std::make_unique<Neg>(node->Derive(s));
+	out << "(" << *terms.front();
+	for (std::size_t i = 1; i < terms.size(); i++)
+		out << " + " << *terms[i];
+	out << ")";
 }
 
-std::unique_ptr<Node> Add::Derive(const Symbol& s) const
+void Mul::Write(Writer& out) const
 {
-	return std::make_unique<Add>(l->Derive(s), r->Derive(s));
+	out << "(" << *terms.front();
+	for (std::size_t i = 1; i < terms.size(); i++)
+		out << " * " << *terms[i];
+	out << ")";
 }
 
-std::unique_ptr<Node> Sub::Derive(const Symbol& s) const
+
+
+std::uint32_t Add::Compile(Tape& tape) const
+{
+	auto ret = tape.Compile(*terms.front());
+	for (std::size_t i = 1; i < terms.size(); i++)
+		ret = tape.Emit(OpCode::Add, ret, tape.Compile(*terms[i]));
+	return ret;
+}
+
+std::uint32_t Sub::Compile(Tape& tape) const
 {
-	return std::make_unique<Sub>(l->Derive(s), r->Derive(s));
+	auto L = tape.Compile(*l);
+	auto R = tape.Compile(*r);
+	return tape.Emit(OpCode::Sub, L, R);
 }
 
-std::unique_ptr<Node> Mul::Derive(const Symbol& s) const
+std::uint32_t Mul::Compile(Tape& tape) const
 {
-	return std::make_unique<Add>(
-		std::make_unique<Mul>(l->Derive(s), r->Clone()), 
-		std::make_unique<Mul>(l->Clone(), r->Derive(s)));
+	auto ret = tape.Compile(*terms.front());
+	for (std::size_t i = 1; i < terms.size(); i++)
+		ret = tape.Emit(OpCode::Mul, ret, tape.Compile(*terms[i]));
+	return ret;
 }
 
-std::unique_ptr<Node> Div::Derive(const Symbol& s) const
+std::uint32_t Div::Compile(Tape& tape) const
 {
-	return std::make_unique<Div>(
-		std::make_unique<Sub>(
-			std::make_unique<Mul>(l->Derive(s), r->Clone()), 
-			std::make_unique<Mul>(l->Clone(), r->Derive(s))),
-		std::make_unique<Mul>(r->Clone(), r->Clone()));
+	auto L = tape.Compile(*l);
+	auto R = tape.Compile(*r);
+	return tape.Emit(OpCode::Div, L, R);
 }
 
-std::unique_ptr<Node> Pow::Derive(const Symbol& s) const
+std::uint32_t Pow::Compile(Tape& tape) const
 {
-	return std::make_unique<Mul>(
-		Clone(), 
-		std::make_unique<Add>(
-			std::make_unique<Mul>(
-				l->Derive(s),
-				std::make_unique<Log>(r->Clone())),
-			std::make_unique<Mul>(
-				l->Clone(),
-				std::make_unique<Div>(
-					r->Derive(s),
-					r->Clone()))
-			));
+	auto L = tape.Compile(*l);
+	auto R = tape.Compile(*r);
+	return tape.Emit(OpCode::Pow, L, R);
+}
+
+
+
+void Neg::Adjoin(const NodePtr& a, Adjoints& adjoints) const
+{
+	adjoints.Add(node, Make<Neg>(a));
+}
+
+void Add::Adjoin(const NodePtr& a, Adjoints& adjoints) const
+{
+	for (const auto& term : terms)
+		adjoints.Add(term, a);
 }
 
-std::unique_ptr<Node> Exp::Derive(const Symbol& s) const
+void Sub::Adjoin(const NodePtr& a, Adjoints& adjoints) const
 {
-	return std::make_unique<Mul>(Clone(), node->Derive(s));
+	adjoints.Add(l, a);
+	adjoints.Add(r, Make<Neg>(a));
 }
 
-std::unique_ptr<Node> Log::Derive(const Symbol& s) const
+void Mul::Adjoin(const NodePtr& a, Adjoints& adjoints) const
 {
-	return std::make_unique<Div>(node->Derive(s), Clone());
+	// Each factor gets the adjoint times the other factors.
+	for (std::size_t i = 0; i < terms.size(); i++)
+	{
+		Terms product{ a };
+		for (std::size_t j = 0; j < terms.size(); j++)
+			if (j != i)
+				product.push_back(terms[j]);
+		adjoints.Add(terms[i], Make<Mul>(std::move(product)));
+	}
+}
+
+void Div::Adjoin(const NodePtr& a, Adjoints& adjoints) const
+{
+	adjoints.Add(l, Make<Div>(a, r));
+	adjoints.Add(r, Make<Neg>(Make<Div>(Make<Mul>(a, shared_from_this()), r)));
+}
+
+void Pow::Adjoin(const NodePtr& a, Adjoints& adjoints) const
+{
+	adjoints.Add(l, Make<Mul>(a, Make<Mul>(r, Make<Pow>(l, Make<Sub>(r, Make<Value>(1))))));
+	adjoints.Add(r, Make<Mul>(a, Make<Mul>(shared_from_this(), Make<Log>(l))));
+}
+
+void Exp::Adjoin(const NodePtr& a, Adjoints& adjoints) const
+{
+	adjoints.Add(node, Make<Mul>(a, shared_from_this()));
+}
+
+void Log::Adjoin(const NodePtr& a, Adjoints& adjoints) const
+{
+	adjoints.Add(node, Make<Div>(a, node));
 }
 
 
 
-std::unique_ptr<Node> Neg::Simplify() const
+NodePtr Neg::Rewrite(const NodePtr* operands) const
 {
-	auto N = node->Simplify();
+	const NodePtr& N = operands[0];
+
+	if (auto folded = Fold(N))
+	{
+		Stats::Folded(code);
+		return folded;
+	}
+	if (N == node)
+		return shared_from_this();
+	return Make<Neg>(N);
+}
 
+NodePtr Neg::Fold(const NodePtr& N)
+{
 	if (N->has_value())
-		return std::make_unique<Value>(-N->value());
-	if (auto tmp = dynamic_cast<Neg*>(N.get()))
+		return Make<Value>(-N->value());
+	if (auto tmp = dynamic_cast<const Neg*>(N.get()))
 		return tmp->node->Simplify();
-	return std::make_unique<Neg>(std::move(N));
+	if (auto mul = dynamic_cast<const Mul*>(N.get()); mul and mul->operands().front()->has_value())
+	{
+		Terms product = mul->operands();
+		product.front() = Make<Value>(-product.front()->value());
+		return MakeSimplified<Mul>(std::move(product));
+	}
+	return nullptr;
 }
 
-std::unique_ptr<Node> Add::Simplify() const
+NodePtr Add::Rewrite(const NodePtr* operands) const
 {
-	auto L = l->Simplify();
-	auto R = r->Simplify();
+	Terms T(operands, operands + terms.size());
+
+	if (auto folded = Fold(T))
+	{
+		Stats::Folded(code);
+		return folded;
+	}
+	if (T == terms)
+		return shared_from_this();
+	return Make<Add>(std::move(T));
+}
 
+NodePtr Add::Fold(const NodePtr& L, const NodePtr& R)
+{
 	if (L->has_value() and R->has_value())
-		return std::make_unique<Value>(L->value() + R->value());
+		return Make<Value>(L->value() + R->value());
 	if (L->has_value() and L->value() == 0)
 		return R;
 	if (R->has_value() and R->value() == 0)
 		return L;
-	return std::make_unique<Add>(std::move(L), std::move(R));
+
+	// Two plain terms only need ordering
+	auto plain = [](const NodePtr& N) {
+		return not dynamic_cast<const Add*>(N.get()) and not dynamic_cast<const Neg*>(N.get()) and not dynamic_cast<const Mul*>(N.get());
+	};
+	if (L != R and plain(L) and plain(R))
+	{
+		if (R->has_value() or (not L->has_value() and TermBefore(*L, *R)))
+			return nullptr;
+		return Make<Add>(R, L);
+	}
+	return Fold(Terms{ L, R });
 }
 
-std::unique_ptr<Node> Sub::Simplify() const
+NodePtr Add::Fold(const Terms& T)
 {
-	auto L = l->Simplify();
-	auto R = r->Simplify();
+	// Flatten nested sums and split off the constants
+	float constant = 0;
+	std::vector<Monomial, PoolAllocator<Monomial>> monomials;
+	monomials.reserve(FlatSize<Add>(T));
+	auto collect = [&](const NodePtr& term) {
+		if (term->has_value())
+			constant += term->value();
+		else
+			monomials.push_back(MakeMonomial(term));
+	};
+	for (const auto& term : T)
+	{
+		auto add = dynamic_cast<const Add*>(term.get());
+		if (add and add->terms.size() < flatten_limit)
+			std::for_each(add->terms.begin(), add->terms.end(), collect);
+		else
+			collect(term);
+	}
+
+	// Collect like terms
+	std::sort(monomials.begin(), monomials.end(), FactorsBefore);
+	Terms ret;
+	ret.reserve(monomials.size() + 1);
+	for (auto first = monomials.begin(); first != monomials.end();)
+	{
+		auto last = std::find_if_not(first + 1, monomials.end(), [&](const Monomial& m) { return SameFactors(*first, m); });
+		if (last - first == 1)
+			ret.push_back(*first->term);
+		else
+		{
+			float coefficient = 0;
+			for (auto it = first; it != last; ++it)
+				coefficient += it->coefficient;
+			if (coefficient != 0)
+			{
+				if (first->count == 1)
+					ret.push_back(MakeSimplified<Mul>(Make<Value>(coefficient), *first->factors));
+				else
+				{
+					Terms product{ Make<Value>(coefficient) };
+					product.insert(product.end(), first->factors, first->factors + first->count);
+					ret.push_back(MakeSimplified<Mul>(std::move(product)));
+				}
+			}
+		}
+		first = last;
+	}
+	if (constant != 0 or ret.empty())
+		ret.push_back(Make<Value>(constant));
+
+	if (ret.size() == 1)
+		return ret.front();
+	if (ret == T)
+		return nullptr;
+	return Make<Add>(std::move(ret));
+}
+
+NodePtr Sub::Rewrite(const NodePtr* operands) const
+{
+	const NodePtr& L = operands[0];
+	const NodePtr& R = operands[1];
+
+	if (auto folded = Fold(L, R))
+	{
+		Stats::Folded(code);
+		return folded;
+	}
+	if (L == l and R == r)
+		return shared_from_this();
+	return Make<Sub>(L, R);
+}
 
+NodePtr Sub::Fold(const NodePtr& L, const NodePtr& R)
+{
 	if (L->has_value() and R->has_value())
-		return std::make_unique<Value>(L->value() - R->value());
+		return Make<Value>(L->value() - R->value());
 	if (L->has_value() and L->value() == 0)
-		return std::make_unique<Neg>(std::move(R));
+		return MakeSimplified<Neg>(R);
 	if (R->has_value() and R->value() == 0)
 		return L;
-	return std::make_unique<Sub>(std::move(L), std::move(R));
+	if (L == R)
+		return Make<Value>(0);
+	return nullptr;
 }
 
-std::unique_ptr<Node> Mul::Simplify() const
+NodePtr Mul::Rewrite(const NodePtr* operands) const
 {
-	auto L = l->Simplify();
-	auto R = r->Simplify();
+	Terms T(operands, operands + terms.size());
+
+	if (auto folded = Fold(T))
+	{
+		Stats::Folded(code);
+		return folded;
+	}
+	if (T == terms)
+		return shared_from_this();
+	return Make<Mul>(std::move(T));
+}
 
+NodePtr Mul::Fold(const NodePtr& L, const NodePtr& R)
+{
 	if (L->has_value() and R->has_value())
-		return std::make_unique<Value>(L->value() * R->value());
-	if (L->has_value() and L->value() == 0)
-		return std::make_unique<Value>(0);
-	if (R->has_value() and R->value() == 0)
-		return std::make_unique<Value>(0);
+		return Make<Value>(L->value() * R->value());
+	if ((L->has_value() and L->value() == 0) or (R->has_value() and R->value() == 0))
+		return Make<Value>(0);
 	if (L->has_value() and L->value() == 1)
 		return R;
 	if (R->has_value() and R->value() == 1)
 		return L;
-	return std::make_unique<Mul>(std::move(L), std::move(R));
+
+	// Two plain factors only need ordering
+	auto plain = [](const NodePtr& N) {
+		auto pow = dynamic_cast<const Pow*>(N.get());
+		return not dynamic_cast<const Mul*>(N.get()) and not dynamic_cast<const Neg*>(N.get()) and not (pow and pow->operand(1)->has_value());
+	};
+	if (L != R and plain(L) and plain(R))
+	{
+		if (L->has_value() and L->value() == -1)
+			return MakeSimplified<Neg>(R);
+		if (R->has_value() and R->value() == -1)
+			return MakeSimplified<Neg>(L);
+		if (L->has_value() or (not R->has_value() and TermBefore(*L, *R)))
+			return nullptr;
+		return Make<Mul>(R, L);
+	}
+	return Fold(Terms{ L, R });
 }
 
-std::unique_ptr<Node> Div::Simplify() const
+NodePtr Mul::Fold(const Terms& T)
 {
-	auto L = l->Simplify();
-	auto R = r->Simplify();
+	// Flatten nested products, split off the constants and the signs of negations
+	float constant = 1;
+	std::vector<Power, PoolAllocator<Power>> powers;
+	powers.reserve(FlatSize<Mul>(T));
+	auto collect = [&](const NodePtr& factor) {
+		const NodePtr* f = &factor;
+		if (auto neg = dynamic_cast<const Neg*>(f->get()))
+		{
+			constant = -constant;
+			f = &neg->operand(0);
+		}
+		if ((*f)->has_value())
+			constant *= (*f)->value();
+		else if (auto pow = dynamic_cast<const Pow*>(f->get()); pow and pow->operand(1)->has_value())
+			powers.push_back({ &pow->operand(0), pow->operand(1)->value(), f });
+		else
+			powers.push_back({ f, 1, f });
+	};
+	for (const auto& factor : T)
+	{
+		auto mul = dynamic_cast<const Mul*>(factor.get());
+		if (mul and mul->terms.size() < flatten_limit)
+			std::for_each(mul->terms.begin(), mul->terms.end(), collect);
+		else
+			collect(factor);
+	}
+	if (constant == 0)
+		return Make<Value>(0);
+
+	// Collect powers of the same base
+	std::sort(powers.begin(), powers.end(), BaseBefore);
+	Terms ret;
+	ret.reserve(powers.size() + 1);
+	if (constant != 1 and constant != -1)
+		ret.push_back(Make<Value>(constant));
+	for (auto first = powers.begin(); first != powers.end();)
+	{
+		auto last = std::find_if_not(first + 1, powers.end(), [&](const Power& p) { return *p.base == *first->base; });
+		if (last - first == 1)
+			ret.push_back(*first->factor);
+		else
+		{
+			float exponent = 0;
+			for (auto it = first; it != last; ++it)
+				exponent += it->exponent;
+			if (exponent != 0)
+				ret.push_back(MakeSimplified<Pow>(*first->base, Make<Value>(exponent)));
+		}
+		first = last;
+	}
+
+	NodePtr product;
+	if (ret.empty())
+		return Make<Value>(constant);
+	if (ret.size() == 1)
+		product = ret.front();
+	else if (ret == T)
+		return nullptr;
+	else
+		product = Make<Mul>(std::move(ret));
+	return constant == -1 ? MakeSimplified<Neg>(std::move(product)) : product;
+}
 
+NodePtr Div::Rewrite(const NodePtr* operands) const
+{
+	const NodePtr& L = operands[0];
+	const NodePtr& R = operands[1];
+
+	if (auto folded = Fold(L, R))
+	{
+		Stats::Folded(code);
+		return folded;
+	}
+	if (L == l and R == r)
+		return shared_from_this();
+	return Make<Div>(L, R);
+}
+
+NodePtr Div::Fold(const NodePtr& L, const NodePtr& R)
+{
 	if (L->has_value() and R->has_value())
-		return std::make_unique<Value>(L->value() * R->value());
+		return Make<Value>(L->value() / R->value());
 	if (L->has_value() and L->value() == 0)
-		return std::make_unique<Value>(0);
+		return Make<Value>(0);
 	if (R->has_value() and R->value() == 0)
-		return std::make_unique<Value>(std::numeric_limits<float>::infinity());
+		return Make<Value>(std::numeric_limits<float>::infinity());
 	if (R->has_value() and R->value() == 1)
 		return L;
-	return std::make_unique<Div>(std::move(L), std::move(R));
+	if (L == R)
+		return Make<Value>(1);
+	return nullptr;
 }
 
-std::unique_ptr<Node> Pow::Simplify() const
+NodePtr Pow::Rewrite(const NodePtr* operands) const
 {
-	auto L = l->Simplify();
-	auto R = r->Simplify();
+	const NodePtr& L = operands[0];
+	const NodePtr& R = operands[1];
+
+	if (auto folded = Fold(L, R))
+	{
+		Stats::Folded(code);
+		return folded;
+	}
+	if (L == l and R == r)
+		return shared_from_this();
+	return Make<Pow>(L, R);
+}
 
+NodePtr Pow::Fold(const NodePtr& L, const NodePtr& R)
+{
 	if (L->has_value() and R->has_value())
-		return std::make_unique<Value>(std::pow(L->value(), R->value()));
+		return Make<Value>(std::pow(L->value(), R->value()));
 	if (L->has_value() and L->value() == 0)
-		return std::make_unique<Value>(0);
+		return Make<Value>(0);
 	if (L->has_value() and L->value() == 1)
-		return std::make_unique<Value>(1);
+		return Make<Value>(1);
 	if (R->has_value() and R->value() == 0)
-		return std::make_unique<Value>(1);
+		return Make<Value>(1);
 	if (R->has_value() and R->value() == 1)
 		return L;
-	return std::make_unique<Pow>(std::move(L), std::move(R));
+	return nullptr;
 }
 
-std::unique_ptr<Node> Exp::Simplify() const
+NodePtr Exp::Rewrite(const NodePtr* operands) const
 {
-	auto N = node->Simplify();
+	const NodePtr& N = operands[0];
+
+	if (auto folded = Fold(N))
+	{
+		Stats::Folded(code);
+		return folded;
+	}
+	if (N == node)
+		return shared_from_this();
+	return Make<Exp>(N);
+}
 
+NodePtr Exp::Fold(const NodePtr& N)
+{
 	if (N->has_value())
-		return std::make_unique<Value>(std::exp(N->value()));
-	if (auto tmp = dynamic_cast<Log*>(N.get()))
+		return Make<Value>(std::exp(N->value()));
+	if (auto tmp = dynamic_cast<const Log*>(N.get()))
 		return tmp->node->Simplify();
-	return std::make_unique<Exp>(std::move(N));
+	return nullptr;
 }
 
-std::unique_ptr<Node> Log::Simplify() const
+NodePtr Log::Rewrite(const NodePtr* operands) const
 {
-	auto N = node->Simplify();
+	const NodePtr& N = operands[0];
+
+	if (auto folded = Fold(N))
+	{
+		Stats::Folded(code);
+		return folded;
+	}
+	if (N == node)
+		return shared_from_this();
+	return Make<Log>(N);
+}
 
+NodePtr Log::Fold(const NodePtr& N)
+{
 	if (N->has_value())
-		return std::make_unique<Value>(std::log(N->value()));
-	if (auto tmp = dynamic_cast<Exp*>(N.get()))
+		return Make<Value>(std::log(N->value()));
+	if (auto tmp = dynamic_cast<const Exp*>(N.get()))
 		return tmp->node->Simplify();
-	return std::make_unique<Log>(std::move(N));
+	return nullptr;
 }
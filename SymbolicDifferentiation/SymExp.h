@@ -1,45 +1,150 @@
 #pragma once
+#include "CodeGen.h"
+#include "CompiledExp.h"
+#include "NodePool.h"
+#include "Stats.h"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <execution>
 #include <string>
+#include <string_view>
 #include <memory>
+#include <unordered_map>
 #include <ostream>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+#include <variant>
 #include <vector>
 
 // Forward declaration
 class SymExpVec;
 class Var;
+class LetSequence;
+class SparseJacobian;
+class FlatExp;
+struct SparsityPattern;
 namespace AST
 {
 	class Node;
+	class Bindings;
+	class Derivatives;
+	class Writer;
+	using NodePtr = std::shared_ptr<const Node>;
 }
 
 // Wrapper to provide value semantics
+// Nodes are immutable and interned, so copies share the tree.
+// Thread safety: a SymExp may be read, derived, simplified, printed and evaluated from any number of threads
+// at once, including one shared by all of them, and expressions may be built concurrently. The node store
+// and the symbol table are synchronized, and a symbol gets its ID without a lock. Assigning to one SymExp
+// object while another thread uses that same object is a race, as for any value type.
+// Evaluators that keep scratch state, CompiledExp, IncrementalExp and DerivativeCache, are used by one
+// thread at a time; copies of a CompiledExp share the tape and can go one per thread.
 class SymExp
 {
-	std::unique_ptr<AST::Node> root;
+	friend class SymExpVec;
+	friend class SparseJacobian;
+	friend class DerivativeCache;
+	friend class IncrementalExp;
+	friend class FlatExp;
+	friend class MappedExp;
+	friend SparsityPattern JacobianSparsity(const SymExpVec&, const std::vector<Var>&);
+	AST::NodePtr root;
+
+	[[nodiscard]] static AST::Bindings Bind(const std::vector<Var>&, const std::vector<float>& values);
+	[[nodiscard]] static Tape Lower(const std::vector<Var>&);
+	[[nodiscard]] SymExp At(AST::Bindings&) const;
+	[[nodiscard]] std::vector<SymExp> Adjoints(const std::vector<Var>&) const;
 protected:
-	explicit SymExp(std::unique_ptr<AST::Node>&& node) noexcept : root(std::move(node)) {}
+	explicit SymExp(AST::NodePtr node) noexcept : root(std::move(node)) {}
 public:
 	SymExp() = delete;
 	explicit SymExp(float value) noexcept;
 	explicit SymExp(std::string name) noexcept;
 
-	SymExp(const SymExp&) noexcept;
+	SymExp(const SymExp&) noexcept = default;
 	SymExp(SymExp&&) noexcept = default;
-	SymExp& operator=(const SymExp&) noexcept;
+	SymExp& operator=(const SymExp&) noexcept = default;
 	SymExp& operator=(SymExp&&) noexcept = default;
 	~SymExp() = default;
 
 	[[nodiscard]] SymExp At(const Var&, float value) const;
 	[[nodiscard]] SymExp At(const std::vector<Var>&, const std::vector<float>& values) const;
+	// As 'At', without simplifying what the bound symbols do not reach: only the nodes above them are rebuilt,
+	// folding constants where their operands are simplified, and every other subtree is shared as it is.
+	// On a simplified expression this is 'At'.
+	[[nodiscard]] SymExp PartialAt(const Var&, float value) const;
+	[[nodiscard]] SymExp PartialAt(const std::vector<Var>&, const std::vector<float>& values) const;
 	[[nodiscard]] SymExp Derive(const Var&) const;
 	[[nodiscard]] SymExpVec Derive(const std::vector<Var>&) const;
 	[[nodiscard]] SymExpVec DeriveAt(const std::vector<Var>&, const std::vector<float>& values) const;
-	[[nodiscard]] SymExp Simplify() const;
+
+	// Reverse mode: one forward and one backward sweep over the shared expression.
+	[[nodiscard]] SymExpVec Gradient(const std::vector<Var>&) const;
+	[[nodiscard]] std::vector<float> GradientAt(const std::vector<Var>&, const std::vector<float>& values) const;
+
+	// Parallel versions. Results do not depend on the policy.
+	template <typename ExecutionPolicy> requires std::is_execution_policy_v<std::remove_cvref_t<ExecutionPolicy>>
+	[[nodiscard]] SymExpVec Derive(ExecutionPolicy&&, const std::vector<Var>&) const;
+	template <typename ExecutionPolicy> requires std::is_execution_policy_v<std::remove_cvref_t<ExecutionPolicy>>
+	[[nodiscard]] SymExpVec DeriveAt(ExecutionPolicy&&, const std::vector<Var>&, const std::vector<float>& values) const;
+
+	[[nodiscard]] SymExp Simplify() const&;
+	// Moves the tree out, so an already simplified expression is returned without touching the node store.
+	[[nodiscard]] SymExp Simplify() &&;
 	[[nodiscard]] std::string to_string() const;
 
+	// Appends the text of 'to_string' in a single pass, without building intermediate strings.
+	void Write(std::string&) const;
+	void Write(std::ostream&) const;
+
+	// As 'Write', but first defines every subexpression used more than once on its own line
+	// as '$tN = ...' and refers to it by name, so shared subtrees are written once.
+	void WriteShared(std::string&) const;
+	void WriteShared(std::ostream&) const;
+
+	// Reads the text of 'to_string' back in one pass, writing the result gives the same text.
+	// Also reads conventional infix, '*' and '/' binding tighter than '+' and '-' and all of them left to right.
+	// Names are symbols, except 'inf' and 'nan'. Anonymous symbols, written as '$N', and the temporaries of
+	// 'WriteShared' are not read. Throws std::invalid_argument with the offset of the first error.
+	[[nodiscard]] static SymExp Parse(std::string_view);
+
+	// Common subexpression elimination: binds every subexpression used more than once to a temporary.
+	[[nodiscard]] LetSequence CSE() const;
+
+	// Variables the expression depends on, ordered by symbol ID.
+	[[nodiscard]] std::vector<Var> free_variables() const;
+
+	// Lowers the expression into a reusable evaluator taking one input per Var.
+	[[nodiscard]] CompiledExp Compile(const std::vector<Var>&) const;
+
+	// As 'Compile', evaluating in 'Scalar', for example 'Compile<double>' for accuracy.
+	template <typename Scalar>
+	[[nodiscard]] Evaluator<Scalar> Compile(const std::vector<Var>&) const;
+
+	// Source of a standalone function computing the expression and its gradient over 'vars'. See CodeGen.
+	[[nodiscard]] CodeGen Generate(const std::vector<Var>& vars) const;
+
+	// Evaluates 'n' rows, input j of row i is 'inputs[j * n + i]'. See CompiledExp::Batch.
+	void EvaluateBatch(const std::vector<Var>&, const float* inputs, std::size_t n, float* out) const;
+
 	[[nodiscard]] bool has_value() const;
 	[[nodiscard]] float value() const;
 
+	// Structural hash, stable across runs.
+	[[nodiscard]] std::size_t hash() const noexcept;
+
+	// Distinct nodes of the tree, a shared subtree counts once.
+	[[nodiscard]] std::size_t node_count() const;
+	// Nodes on the longest path from the root to a leaf.
+	[[nodiscard]] std::size_t depth() const;
+
+	// Structurally equal expressions share one node, so this is a pointer compare.
+	[[nodiscard]] friend bool operator==(const SymExp& l, const SymExp& r) noexcept { return l.root == r.root; }
+
 	friend SymExp operator-(SymExp);
 	friend SymExp operator+(SymExp, SymExp);
 	friend SymExp operator-(SymExp, SymExp);
@@ -59,6 +164,19 @@ public:
 	[[nodiscard]] SymExpVec At(const Var&, float value) const;
 	[[nodiscard]] SymExpVec At(const std::vector<Var>&, const std::vector<float>& values) const;
 
+	// Jacobian, one row per element.
+	[[nodiscard]] std::vector<SymExpVec> Derive(const std::vector<Var>&) const;
+
+	// Parallel versions. Results do not depend on the policy.
+	template <typename ExecutionPolicy> requires std::is_execution_policy_v<std::remove_cvref_t<ExecutionPolicy>>
+	[[nodiscard]] SymExpVec At(ExecutionPolicy&&, const std::vector<Var>&, const std::vector<float>& values) const;
+	template <typename ExecutionPolicy> requires std::is_execution_policy_v<std::remove_cvref_t<ExecutionPolicy>>
+	[[nodiscard]] std::vector<SymExpVec> Derive(ExecutionPolicy&&, const std::vector<Var>&) const;
+	template <typename ExecutionPolicy> requires std::is_execution_policy_v<std::remove_cvref_t<ExecutionPolicy>>
+	[[nodiscard]] std::vector<float> value(ExecutionPolicy&&) const;
+
+	[[nodiscard]] std::size_t size() const noexcept { return vec.size(); }
+
 	[[nodiscard]] auto begin() noexcept { return vec.begin(); }
 	[[nodiscard]] auto begin() const noexcept { return vec.begin(); }
 	[[nodiscard]] auto cbegin() const noexcept { return vec.cbegin(); }
@@ -68,19 +186,87 @@ public:
 
 	[[nodiscard]] std::vector<float> value() const;
 
+	// Source of a standalone function computing every element and the Jacobian over 'vars'. See CodeGen.
+	[[nodiscard]] CodeGen Generate(const std::vector<Var>& vars) const;
+
 	operator std::vector<SymExp>() { return vec; }
 };
 
 class Var final : public SymExp
 {
+	friend class SymExp;
+	explicit Var(AST::NodePtr symbol) noexcept : SymExp(std::move(symbol)) {}
 public:
 	Var() noexcept;
 	Var(std::string name) noexcept;
 	Var(float value) noexcept;
 };
 
+template <typename Scalar>
+Evaluator<Scalar> SymExp::Compile(const std::vector<Var>& vars) const
+{
+	Tape tape = Lower(vars);
+	tape.Compile(*root);
+	return Evaluator<Scalar>{ std::move(tape) };
+}
+
+template <typename ExecutionPolicy> requires std::is_execution_policy_v<std::remove_cvref_t<ExecutionPolicy>>
+SymExpVec SymExp::Derive(ExecutionPolicy&& policy, const std::vector<Var>& vars) const
+{
+	Stats::Scope scope(Stats::Pass::Gradient);
+	// The reverse sweep is sequential, simplifying the adjoints is not.
+	std::vector<SymExp> ret = Adjoints(vars);
+	std::transform(policy, ret.begin(), ret.end(), ret.begin(),
+		[depth = Stats::Depth()](SymExp& e) { Stats::Nested nested(depth); return std::move(e).Simplify(); });
+	return ret;
+}
+
+template <typename ExecutionPolicy> requires std::is_execution_policy_v<std::remove_cvref_t<ExecutionPolicy>>
+SymExpVec SymExp::DeriveAt(ExecutionPolicy&& policy, const std::vector<Var>& vars, const std::vector<float>& values) const
+{
+	return Derive(policy, vars).At(policy, vars, values);
+}
+
+template <typename ExecutionPolicy> requires std::is_execution_policy_v<std::remove_cvref_t<ExecutionPolicy>>
+SymExpVec SymExpVec::At(ExecutionPolicy&& policy, const std::vector<Var>& vars, const std::vector<float>& values) const
+{
+	// Each task gets its own copy of the environment, its memo is not thread-safe.
+	const auto bindings = SymExp::Bind(vars, values);
+	std::vector<SymExp> ret = vec;
+	std::transform(policy, vec.begin(), vec.end(), ret.begin(),
+		[&bindings](const SymExp& e) { auto b = bindings; return e.At(b); });
+	return ret;
+}
+
+template <typename ExecutionPolicy> requires std::is_execution_policy_v<std::remove_cvref_t<ExecutionPolicy>>
+std::vector<SymExpVec> SymExpVec::Derive(ExecutionPolicy&& policy, const std::vector<Var>& vars) const
+{
+	std::vector<SymExpVec> ret(vec.size(), SymExpVec{ {} });
+	std::transform(policy, vec.begin(), vec.end(), ret.begin(), [&vars](const SymExp& e) { return e.Derive(vars); });
+	return ret;
+}
+
+template <typename ExecutionPolicy> requires std::is_execution_policy_v<std::remove_cvref_t<ExecutionPolicy>>
+std::vector<float> SymExpVec::value(ExecutionPolicy&& policy) const
+{
+	std::vector<float> ret(vec.size());
+	std::transform(policy, vec.begin(), vec.end(), ret.begin(), [](const SymExp& e) { return e.value(); });
+	return ret;
+}
+
+// Temporaries, each defined in terms of the inputs and the previous ones, followed by the result.
+class LetSequence
+{
+public:
+	std::vector<std::pair<Var, SymExp>> temporaries;
+	SymExp result;
+
+	[[nodiscard]] std::string to_string() const;
+};
+
 [[nodiscard]] inline std::string to_string(const SymExp& se) { return se.to_string(); }
-[[nodiscard]] inline std::ostream& operator<<(std::ostream& os, const SymExp& se) { return os << to_string(se); }
+inline std::ostream& operator<<(std::ostream& os, const SymExp& se) { se.Write(os); return os; }
+inline std::ostream& operator<<(std::ostream& os, const LetSequence& let) { return os << let.to_string(); }
 
 
 namespace AST
@@ -96,155 +282,578 @@ namespace AST
 	class Pow;
 	class Exp;
 	class Log;
+	class Adjoints;
+	class Bindings;
+	class Derivatives;
+
+	[[nodiscard]] inline std::size_t HashCombine(std::size_t seed, std::size_t value) noexcept
+	{
+		return seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+	}
+
+	// Exact set of symbol IDs, the free symbols of a node. IDs below 'mask_ids' are bits of a mask.
+	// Higher IDs set the last bit and are listed in sorted order, the list shared between the sets
+	// that hold the same higher IDs, so a node built from its operands copies a pointer unless they differ.
+	class SymbolSet
+	{
+		static constexpr std::uint32_t mask_ids = 63;
+		static constexpr std::uint64_t listed = std::uint64_t{ 1 } << mask_ids;
+
+		std::uint64_t mask = 0;
+		std::shared_ptr<const std::vector<std::uint32_t>> ids; // IDs from 'mask_ids' on, null when there are none
+	public:
+		SymbolSet() noexcept = default;
+		explicit SymbolSet(std::uint32_t id);
+
+		[[nodiscard]] bool empty() const noexcept { return mask == 0; }
+		[[nodiscard]] bool contains(std::uint32_t id) const noexcept
+		{
+			if (id < mask_ids)
+				return mask & std::uint64_t{ 1 } << id;
+			return ids and std::binary_search(ids->begin(), ids->end(), id);
+		}
+		[[nodiscard]] bool intersects(const SymbolSet&) const noexcept;
+
+		SymbolSet& operator|=(const SymbolSet&);
+		[[nodiscard]] friend SymbolSet operator|(SymbolSet a, const SymbolSet& b) { return a |= b; }
+	};
+
+	// Appends text to a caller-supplied string or stream.
+	// Nodes that were given a name are written as that name instead of their expansion.
+	// Operands are written recursively up to 'max_depth'. Deeper subtrees are expanded one node at a time from
+	// an explicit stack: while a node writes itself, its operands and any text following them are queued,
+	// so text written after an operand must outlive the write.
+	class Writer
+	{
+		using Part = std::variant<std::string_view, float, const Node*>;
+		static constexpr std::size_t max_depth = 256;
+
+		std::string* buffer = nullptr;
+		std::ostream* stream = nullptr;
+		std::unordered_map<const Node*, std::string> names;
+		std::vector<Part>* parts = nullptr; // pending parts, the expansion of the node being written is queued from 'first'
+		std::size_t first = 0;
+		std::size_t depth = 0;
+
+		[[nodiscard]] const std::string* Find(const Node&) const;
+
+		void Put(std::string_view);
+		void Put(float);
+	public:
+		explicit Writer(std::string& buffer) noexcept : buffer(&buffer) {}
+		explicit Writer(std::ostream& stream) noexcept : stream(&stream) {}
+
+		void Name(const Node&, std::string);
+
+		Writer& operator<<(std::string_view);
+		Writer& operator<<(float);
+		Writer& operator<<(const Node&);
+	};
 
 	// Interface
-	class Node
+	// Nodes are immutable. The node store holds each structurally distinct node once, see 'Make'.
+	class Node : public std::enable_shared_from_this<Node>
 	{
+		std::size_t structural_hash;
+		SymbolSet symbol_set; // every free symbol
+		mutable std::atomic<bool> simplified{ false }; // 'Simplify' returns the node itself
+	protected:
+		Node(std::size_t hash, SymbolSet symbols) noexcept : structural_hash(hash), symbol_set(std::move(symbols)) {}
+		Node(const Node& o) noexcept : enable_shared_from_this(o), structural_hash(o.structural_hash), symbol_set(o.symbol_set) {}
+
+		// Applies the simplification rules of this node on top of its simplified operands, 'arity()' of them.
+		// Each node type also has a static 'Fold' with these rules, returning null when none applies, see 'MakeSimplified'.
+		[[nodiscard]] virtual NodePtr Rewrite(const NodePtr* operands) const = 0;
+
+		template <typename T, typename... Args>
+		friend NodePtr MakeSimplified(Args&&...);
+		friend class Bindings;
 	public:
+		virtual ~Node() = default;
+
+		static void* operator new(std::size_t size) { return NodePool::Allocate(size); }
+		static void operator delete(void* p, std::size_t size) noexcept { NodePool::Deallocate(p, size); }
+
+		// Kind of node, as the instruction it lowers to. Symbols are 'Input'.
+		[[nodiscard]] virtual OpCode op() const noexcept = 0;
+		// Shallow copy, children are shared.
 		[[nodiscard]] virtual std::unique_ptr<Node> Clone() const noexcept = 0;
-		[[nodiscard]] virtual std::unique_ptr<Node> Eval(const Symbol&, float value) const = 0;
-		[[nodiscard]] virtual std::unique_ptr<Node> Derive(const Symbol&) const = 0;
-		[[nodiscard]] virtual std::unique_ptr<Node> Simplify() const = 0;
-		[[nodiscard]] virtual std::string to_string() const = 0;
+		// Value of a leaf under the bindings. Nodes with operands are rebuilt by 'Bindings::Eval'.
+		[[nodiscard]] virtual NodePtr Eval(Bindings&) const { return shared_from_this(); }
+		// Simplified derivative of this simplified node, with the derivatives of its operands taken from 'Derivatives'.
+		// Built through 'MakeSimplified' so no unsimplified intermediate is created.
+		[[nodiscard]] virtual NodePtr Derive(Derivatives&) const = 0;
+		// Results are marked, so simplifying an already simplified tree returns it at once, without allocating.
+		// Runs on 'Traverse', rewriting each distinct node once.
+		[[nodiscard]] NodePtr Simplify() const;
+		[[nodiscard]] std::string to_string() const;
+
+		// Writes the text of this node, its operands through 'Writer::operator<<'.
+		virtual void Write(Writer&) const = 0;
+
+		// Appends the postorder instructions of this node to the tape and returns the slot of its result.
+		virtual std::uint32_t Compile(Tape&) const = 0;
+
+		// Adds the contributions of this node's adjoint to the adjoints of its operands.
+		virtual void Adjoin(const NodePtr& adjoint, Adjoints&) const = 0;
+
+		// Node of the same kind with the given operands, 'arity()' of them.
+		[[nodiscard]] virtual NodePtr Rebuild(const NodePtr*) const { return shared_from_this(); }
+
+		[[nodiscard]] virtual std::size_t arity() const noexcept { return 0; }
+		[[nodiscard]] virtual const NodePtr& operand(std::size_t) const { throw; }
+
+		// Structural equality, with children compared by identity.
+		[[nodiscard]] virtual bool Equal(const Node&) const noexcept = 0;
+		[[nodiscard]] std::size_t hash() const noexcept { return structural_hash; }
+
+		// Free symbols. Subtrees without a symbol cannot depend on it.
+		[[nodiscard]] const SymbolSet& symbols() const noexcept { return symbol_set; }
+		[[nodiscard]] bool mentions(const Symbol&) const noexcept;
 
 		[[nodiscard]] virtual bool has_value() const { return false; }
 		[[nodiscard]] virtual float value() const { throw; }
 	};
 
+	// Operands of a sum or product.
+	using Terms = std::vector<NodePtr, PoolAllocator<NodePtr>>;
+
+	// Sums and products with at least this many operands are not flattened into the sums and products
+	// using them, so simplifying a long chain of binary operations stays linear.
+	constexpr std::size_t flatten_limit = 64;
+
+	// Per-pass memo keyed by node identity, with its entries in the node pool.
+	template <typename T>
+	using NodeMap = std::unordered_map<const Node*, T, std::hash<const Node*>, std::equal_to<const Node*>, PoolAllocator<std::pair<const Node* const, T>>>;
+
+	// Returns the interned node structurally equal to 'candidate'.
+	[[nodiscard]] NodePtr Intern(const Node& candidate);
+
+	template <typename T, typename... Args>
+	[[nodiscard]] NodePtr Make(Args&&... args)
+	{
+		return Intern(T(std::forward<Args>(args)...));
+	}
+
+	// Smart constructor: node 'T' over simplified operands, with the simplification rules of 'T' applied first.
+	// Folded results never create the 'T' node, and the result is marked simplified.
+	template <typename T, typename... Args>
+	[[nodiscard]] NodePtr MakeSimplified(Args&&... operands)
+	{
+		NodePtr ret = T::Fold(operands...);
+		if (ret)
+			Stats::Folded(T::code);
+		else
+			ret = Make<T>(std::forward<Args>(operands)...);
+		ret->simplified.store(true, std::memory_order_relaxed);
+		return ret;
+	}
+
+	// Number of distinct nodes currently alive.
+	[[nodiscard]] std::size_t NodeCount();
+
+	// Highest 'NodeCount()' since the last reset. Resetting starts over from the current count.
+	std::size_t PeakNodeCount(bool reset = false);
+
+	// Calls 'visit' on the nodes reachable from 'root' that 'enter' accepts, operands before their users.
+	// The operands of rejected nodes are not visited. An explicit stack replaces recursion, so the depth
+	// of a tree is bounded by memory only. A node reached again is offered to 'enter' again, so 'visit'
+	// has to make 'enter' reject it, typically by memoizing its result.
+	template <typename Enter, typename Visit>
+	void Traverse(const Node& root, Enter&& enter, Visit&& visit)
+	{
+		if (not enter(&root))
+			return;
+		std::vector<std::pair<const Node*, std::size_t>> stack{ { &root, 0 } };
+		while (not stack.empty())
+		{
+			auto& [node, i] = stack.back();
+			if (i < node->arity())
+			{
+				const Node* next = node->operand(i++).get();
+				if (enter(next))
+					stack.push_back({ next, 0 });
+			}
+			else
+			{
+				const Node* done = node;
+				stack.pop_back();
+				visit(done);
+			}
+		}
+	}
+
+	// Every distinct node reachable from 'root', operands before their users.
+	[[nodiscard]] std::vector<const Node*> Postorder(const Node& root);
+
+	// Adjoints of a reverse sweep, keyed by node identity.
+	class Adjoints
+	{
+		std::unordered_map<const Node*, NodePtr> map;
+	public:
+		void Add(const NodePtr& node, NodePtr contribution);
+		[[nodiscard]] NodePtr operator[](const Node*) const;
+	};
+
+	// Values bound to symbols for a single substitution pass.
+	class Bindings
+	{
+		std::unordered_map<const Node*, float> values;
+		NodeMap<NodePtr> memo;
+		SymbolSet bound; // the bound symbols
+		std::vector<NodePtr> operands;
+
+		[[nodiscard]] NodePtr Substitute(const Node&);
+	public:
+		// The first value bound to a symbol wins.
+		void Bind(const Symbol&, float value);
+		[[nodiscard]] const float* Find(const Symbol&) const;
+
+		// Substitutes the bound symbols in 'node', visiting each distinct node once.
+		// Subtrees that mention none of them are shared untouched. Only the nodes above a bound symbol
+		// are rebuilt, and those whose operands all end up simplified are simplified on the way.
+		[[nodiscard]] NodePtr Eval(const Node&);
+	};
+
+	// Derivatives with respect to one symbol for a single differentiation pass.
+	class Derivatives
+	{
+		const Symbol& symbol;
+		NodeMap<NodePtr> memo;
+	public:
+		explicit Derivatives(const Symbol& s) noexcept : symbol(s) {}
+
+		[[nodiscard]] const Symbol& variable() const noexcept { return symbol; }
+
+		// Derivative of the simplified 'node', deriving each distinct node once, operands first.
+		// Subtrees that do not mention the symbol are 0 without being visited.
+		[[nodiscard]] NodePtr Derive(const Node&);
+
+		// Derivative of 'node' derived earlier, null when there is none.
+		[[nodiscard]] NodePtr Find(const Node& node) const
+		{
+			auto it = memo.find(&node);
+			return it == memo.end() ? nullptr : it->second;
+		}
+		// Records the simplified derivative of the simplified 'node', computed elsewhere.
+		void Insert(const Node& node, NodePtr derivative) { memo.emplace(&node, std::move(derivative)); }
+
+		[[nodiscard]] std::size_t size() const noexcept { return memo.size(); }
+	};
+
 	class Value final : public Node
 	{
 		float val;
 	public:
-		Value(float value) noexcept : val(value) {}
+		Value(float value) noexcept : Node(HashCombine(static_cast<std::size_t>(OpCode::Value), std::bit_cast<std::uint32_t>(value)), {}), val(value) {}
 
+		static constexpr OpCode code = OpCode::Value;
+
+		[[nodiscard]] OpCode op() const noexcept override { return code; }
 		[[nodiscard]] std::unique_ptr<Node> Clone() const noexcept override { return std::make_unique<Value>(val); }
-		[[nodiscard]] std::unique_ptr<Node> Eval(const Symbol&, float value) const override { return Clone(); }
-		[[nodiscard]] std::unique_ptr<Node> Derive(const Symbol&) const override { return std::make_unique<Value>(0); }
-		[[nodiscard]] std::unique_ptr<Node> Simplify() const override { return Clone(); }
-		[[nodiscard]] std::string to_string() const override { return std::to_string(val); }
+		[[nodiscard]] NodePtr Derive(Derivatives&) const override { return Make<Value>(0); }
+		[[nodiscard]] NodePtr Rewrite(const NodePtr*) const override { return shared_from_this(); }
+		void Write(Writer& out) const override { out << val; }
+		std::uint32_t Compile(Tape& tape) const override { return tape.Value(val); }
+		void Adjoin(const NodePtr&, Adjoints&) const override {}
+		[[nodiscard]] bool Equal(const Node& o) const noexcept override
+		{
+			auto p = dynamic_cast<const Value*>(&o);
+			return p and std::bit_cast<std::uint32_t>(p->val) == std::bit_cast<std::uint32_t>(val);
+		}
 
 		[[nodiscard]] bool has_value() const override { return true; }
 		[[nodiscard]] float value() const override { return val; }
 	};
 
+	// Symbol table. Symbols with the same name share one ID, anonymous symbols get a fresh one.
+	// Safe to call from any thread, 'NewSymbolId' takes no lock.
+	[[nodiscard]] std::uint32_t SymbolId(const std::string& name);
+	[[nodiscard]] std::uint32_t NewSymbolId();
+	[[nodiscard]] std::string SymbolName(std::uint32_t id);
+	[[nodiscard]] bool SymbolNamed(std::uint32_t id);
+	// Interned node of the symbol with ID 'id', named or anonymous.
+	[[nodiscard]] NodePtr SymbolNode(std::uint32_t id);
+
 	class Symbol final : public Node
 	{
-		static int counter;
-		std::string name;
-	public:
-		Symbol() noexcept : name('$' + std::to_string(counter++)) {}
-		Symbol(std::string name) noexcept : name(std::move(name)) {}
+		std::uint32_t uid;
 
-		[[nodiscard]] std::unique_ptr<Node> Clone() const noexcept override { return std::make_unique<Symbol>(name); }
-		[[nodiscard]] std::unique_ptr<Node> Eval(const Symbol& s, float value) const override { return s.name == name ? std::make_unique<Value>(value) : Clone(); }
-		[[nodiscard]] std::unique_ptr<Node> Derive(const Symbol& s) const override { return std::make_unique<Value>(s.name == name ? 1 : 0); }
-		[[nodiscard]] std::unique_ptr<Node> Simplify() const override { return Clone(); }
-		[[nodiscard]] std::string to_string() const override { return name; }
+		Symbol(std::uint32_t id, std::size_t hash) : Node(HashCombine(static_cast<std::size_t>(OpCode::Input), hash), SymbolSet(id)), uid(id) {}
+	public:
+		Symbol() : Symbol(NewSymbolId()) {}
+		Symbol(const std::string& name) : Symbol(SymbolId(name), std::hash<std::string>{}(name)) {}
+		explicit Symbol(std::uint32_t id) : Symbol(id, id) {}
+		Symbol(const Symbol&) noexcept = default;
+
+		[[nodiscard]] std::uint32_t id() const noexcept { return uid; }
+
+		static constexpr OpCode code = OpCode::Input;
+
+		[[nodiscard]] OpCode op() const noexcept override { return code; }
+		[[nodiscard]] std::unique_ptr<Node> Clone() const noexcept override { return std::make_unique<Symbol>(*this); }
+		[[nodiscard]] NodePtr Eval(Bindings&) const override;
+		[[nodiscard]] NodePtr Derive(Derivatives& d) const override { return Make<Value>(d.variable().uid == uid ? 1 : 0); }
+		[[nodiscard]] NodePtr Rewrite(const NodePtr*) const override { return shared_from_this(); }
+		void Write(Writer& out) const override { out << SymbolName(uid); }
+		std::uint32_t Compile(Tape& tape) const override { return tape.Input(*this); }
+		void Adjoin(const NodePtr&, Adjoints&) const override {}
+		[[nodiscard]] bool Equal(const Node& o) const noexcept override
+		{
+			auto p = dynamic_cast<const Symbol*>(&o);
+			return p and p->uid == uid;
+		}
 	};
 
+	inline bool Node::mentions(const Symbol& s) const noexcept
+	{
+		return symbol_set.contains(s.id());
+	}
+
+	[[nodiscard]] inline std::size_t HashTerms(OpCode op, const Terms& terms) noexcept
+	{
+		std::size_t hash = static_cast<std::size_t>(op);
+		for (const auto& term : terms)
+			hash = HashCombine(hash, term->hash());
+		return hash;
+	}
+
+	[[nodiscard]] inline SymbolSet SymbolsOf(const Terms& terms)
+	{
+		SymbolSet symbols;
+		for (const auto& term : terms)
+			symbols |= term->symbols();
+		return symbols;
+	}
+
 	class Neg final : public Node
 	{
-		std::unique_ptr<Node> node;
+		NodePtr node;
 	public:
-		Neg(std::unique_ptr<Node>&& node) noexcept : node(std::move(node)) {}
-
-		[[nodiscard]] std::unique_ptr<Node> Clone() const noexcept override { return std::make_unique<Neg>(node->Clone()); }
-		[[nodiscard]] std::unique_ptr<Node> Eval(const Symbol&, float value) const override;
-		[[nodiscard]] std::unique_ptr<Node> Derive(const Symbol& s) const override;
-		[[nodiscard]] std::unique_ptr<Node> Simplify() const override;
-		[[nodiscard]] std::string to_string() const override { return "-(" + node->to_string() + ")"; }
+		Neg(NodePtr node) noexcept : Node(HashCombine(static_cast<std::size_t>(OpCode::Neg), node->hash()), node->symbols()), node(std::move(node)) {}
+
+		static constexpr OpCode code = OpCode::Neg;
+
+		[[nodiscard]] OpCode op() const noexcept override { return code; }
+		[[nodiscard]] std::unique_ptr<Node> Clone() const noexcept override { return std::make_unique<Neg>(node); }
+		[[nodiscard]] NodePtr Derive(Derivatives&) const override;
+		[[nodiscard]] NodePtr Rewrite(const NodePtr* operands) const override;
+		[[nodiscard]] static NodePtr Fold(const NodePtr&);
+		void Write(Writer& out) const override { out << "-(" << *node << ")"; }
+		std::uint32_t Compile(Tape& tape) const override { return tape.Emit(OpCode::Neg, tape.Compile(*node)); }
+		void Adjoin(const NodePtr& adjoint, Adjoints&) const override;
+		[[nodiscard]] bool Equal(const Node& o) const noexcept override
+		{
+			auto p = dynamic_cast<const Neg*>(&o);
+			return p and p->node == node;
+		}
+		[[nodiscard]] NodePtr Rebuild(const NodePtr* operands) const override { return Make<Neg>(operands[0]); }
+
+		[[nodiscard]] std::size_t arity() const noexcept override { return 1; }
+		[[nodiscard]] const NodePtr& operand(std::size_t) const override { return node; }
 	};
 
+	// Sum of two or more terms. 'operator+' builds binary sums, simplified sums are flat and canonical:
+	// like terms share one coefficient, the terms are ordered by structural hash and a nonzero constant comes last.
 	class Add final : public Node
 	{
-		std::unique_ptr<Node> l, r;
+		Terms terms;
 	public:
-		Add(std::unique_ptr<Node>&& l, std::unique_ptr<Node>&& r) noexcept : l(std::move(l)), r(std::move(r)) {}
-
-		[[nodiscard]] std::unique_ptr<Node> Clone() const noexcept override { return std::make_unique<Add>(l->Clone(), r->Clone()); }
-		[[nodiscard]] std::unique_ptr<Node> Eval(const Symbol&, float value) const override;
-		[[nodiscard]] std::unique_ptr<Node> Derive(const Symbol& s) const override;
-		[[nodiscard]] std::unique_ptr<Node> Simplify() const override;
-		[[nodiscard]] std::string to_string() const override { return "(" + l->to_string() + " + " + r->to_string() + ")"; }
+		Add(NodePtr l, NodePtr r) : Add(Terms{ std::move(l), std::move(r) }) {}
+		explicit Add(Terms terms) : Node(HashTerms(OpCode::Add, terms), SymbolsOf(terms)), terms(std::move(terms)) {}
+
+		[[nodiscard]] const Terms& operands() const noexcept { return terms; }
+
+		static constexpr OpCode code = OpCode::Add;
+
+		[[nodiscard]] OpCode op() const noexcept override { return code; }
+		[[nodiscard]] std::unique_ptr<Node> Clone() const noexcept override { return std::make_unique<Add>(terms); }
+		[[nodiscard]] NodePtr Derive(Derivatives&) const override;
+		[[nodiscard]] NodePtr Rewrite(const NodePtr* operands) const override;
+		[[nodiscard]] static NodePtr Fold(const NodePtr&, const NodePtr&);
+		[[nodiscard]] static NodePtr Fold(const Terms&);
+		void Write(Writer& out) const override;
+		std::uint32_t Compile(Tape& tape) const override;
+		void Adjoin(const NodePtr& adjoint, Adjoints&) const override;
+		[[nodiscard]] bool Equal(const Node& o) const noexcept override
+		{
+			auto p = dynamic_cast<const Add*>(&o);
+			return p and p->terms == terms;
+		}
+		[[nodiscard]] NodePtr Rebuild(const NodePtr* operands) const override { return Make<Add>(Terms(operands, operands + terms.size())); }
+
+		[[nodiscard]] std::size_t arity() const noexcept override { return terms.size(); }
+		[[nodiscard]] const NodePtr& operand(std::size_t i) const override { return terms[i]; }
 	};
 
 	class Sub final : public Node
 	{
-		std::unique_ptr<Node> l, r;
+		NodePtr l, r;
 	public:
-		Sub(std::unique_ptr<Node>&& l, std::unique_ptr<Node>&& r) noexcept : l(std::move(l)), r(std::move(r)) {}
-
-		[[nodiscard]] std::unique_ptr<Node> Clone() const noexcept override { return std::make_unique<Sub>(l->Clone(), r->Clone()); }
-		[[nodiscard]] std::unique_ptr<Node> Eval(const Symbol&, float value) const override;
-		[[nodiscard]] std::unique_ptr<Node> Derive(const Symbol& s) const override;
-		[[nodiscard]] std::unique_ptr<Node> Simplify() const override;
-		[[nodiscard]] std::string to_string() const override { return "(" + l->to_string() + " - " + r->to_string() + ")"; }
+		Sub(NodePtr l, NodePtr r) : Node(HashCombine(HashCombine(static_cast<std::size_t>(OpCode::Sub), l->hash()), r->hash()), l->symbols() | r->symbols()), l(std::move(l)), r(std::move(r)) {}
+
+		static constexpr OpCode code = OpCode::Sub;
+
+		[[nodiscard]] OpCode op() const noexcept override { return code; }
+		[[nodiscard]] std::unique_ptr<Node> Clone() const noexcept override { return std::make_unique<Sub>(l, r); }
+		[[nodiscard]] NodePtr Derive(Derivatives&) const override;
+		[[nodiscard]] NodePtr Rewrite(const NodePtr* operands) const override;
+		[[nodiscard]] static NodePtr Fold(const NodePtr&, const NodePtr&);
+		void Write(Writer& out) const override { out << "(" << *l << " - " << *r << ")"; }
+		std::uint32_t Compile(Tape& tape) const override;
+		void Adjoin(const NodePtr& adjoint, Adjoints&) const override;
+		[[nodiscard]] bool Equal(const Node& o) const noexcept override
+		{
+			auto p = dynamic_cast<const Sub*>(&o);
+			return p and p->l == l and p->r == r;
+		}
+		[[nodiscard]] NodePtr Rebuild(const NodePtr* operands) const override { return Make<Sub>(operands[0], operands[1]); }
+
+		[[nodiscard]] std::size_t arity() const noexcept override { return 2; }
+		[[nodiscard]] const NodePtr& operand(std::size_t i) const override { return i == 0 ? l : r; }
 	};
 
+	// Product of two or more factors. 'operator*' builds binary products, simplified products are flat and canonical:
+	// powers of a base are collected, the factors are ordered by structural hash and a constant other than 1 comes first,
+	// a factor of -1 is written as a negation.
 	class Mul final : public Node
 	{
-		std::unique_ptr<Node> l, r;
+		Terms terms;
 	public:
-		Mul(std::unique_ptr<Node>&& l, std::unique_ptr<Node>&& r) noexcept : l(std::move(l)), r(std::move(r)) {}
-
-		[[nodiscard]] std::unique_ptr<Node> Clone() const noexcept override { return std::make_unique<Mul>(l->Clone(), r->Clone()); }
-		[[nodiscard]] std::unique_ptr<Node> Eval(const Symbol&, float value) const override;
-		[[nodiscard]] std::unique_ptr<Node> Derive(const Symbol& s) const override;
-		[[nodiscard]] std::unique_ptr<Node> Simplify() const override;
-		[[nodiscard]] std::string to_string() const override { return "(" + l->to_string() + " * " + r->to_string() + ")"; }
+		Mul(NodePtr l, NodePtr r) : Mul(Terms{ std::move(l), std::move(r) }) {}
+		explicit Mul(Terms terms) : Node(HashTerms(OpCode::Mul, terms), SymbolsOf(terms)), terms(std::move(terms)) {}
+
+		[[nodiscard]] const Terms& operands() const noexcept { return terms; }
+
+		static constexpr OpCode code = OpCode::Mul;
+
+		[[nodiscard]] OpCode op() const noexcept override { return code; }
+		[[nodiscard]] std::unique_ptr<Node> Clone() const noexcept override { return std::make_unique<Mul>(terms); }
+		[[nodiscard]] NodePtr Derive(Derivatives&) const override;
+		[[nodiscard]] NodePtr Rewrite(const NodePtr* operands) const override;
+		[[nodiscard]] static NodePtr Fold(const NodePtr&, const NodePtr&);
+		[[nodiscard]] static NodePtr Fold(const Terms&);
+		void Write(Writer& out) const override;
+		std::uint32_t Compile(Tape& tape) const override;
+		void Adjoin(const NodePtr& adjoint, Adjoints&) const override;
+		[[nodiscard]] bool Equal(const Node& o) const noexcept override
+		{
+			auto p = dynamic_cast<const Mul*>(&o);
+			return p and p->terms == terms;
+		}
+		[[nodiscard]] NodePtr Rebuild(const NodePtr* operands) const override { return Make<Mul>(Terms(operands, operands + terms.size())); }
+
+		[[nodiscard]] std::size_t arity() const noexcept override { return terms.size(); }
+		[[nodiscard]] const NodePtr& operand(std::size_t i) const override { return terms[i]; }
 	};
 
 	class Div final : public Node
 	{
-		std::unique_ptr<Node> l, r;
+		NodePtr l, r;
 	public:
-		Div(std::unique_ptr<Node>&& l, std::unique_ptr<Node>&& r) noexcept : l(std::move(l)), r(std::move(r)) {}
-
-		[[nodiscard]] std::unique_ptr<Node> Clone() const noexcept override { return std::make_unique<Div>(l->Clone(), r->Clone()); }
-		[[nodiscard]] std::unique_ptr<Node> Eval(const Symbol&, float value) const override;
-		[[nodiscard]] std::unique_ptr<Node> Derive(const Symbol& s) const override;
-		[[nodiscard]] std::unique_ptr<Node> Simplify() const override;
-		[[nodiscard]] std::string to_string() const override { return "(" + l->to_string() + " / " + r->to_string() + ")"; }
+		Div(NodePtr l, NodePtr r) : Node(HashCombine(HashCombine(static_cast<std::size_t>(OpCode::Div), l->hash()), r->hash()), l->symbols() | r->symbols()), l(std::move(l)), r(std::move(r)) {}
+
+		static constexpr OpCode code = OpCode::Div;
+
+		[[nodiscard]] OpCode op() const noexcept override { return code; }
+		[[nodiscard]] std::unique_ptr<Node> Clone() const noexcept override { return std::make_unique<Div>(l, r); }
+		[[nodiscard]] NodePtr Derive(Derivatives&) const override;
+		[[nodiscard]] NodePtr Rewrite(const NodePtr* operands) const override;
+		[[nodiscard]] static NodePtr Fold(const NodePtr&, const NodePtr&);
+		void Write(Writer& out) const override { out << "(" << *l << " / " << *r << ")"; }
+		std::uint32_t Compile(Tape& tape) const override;
+		void Adjoin(const NodePtr& adjoint, Adjoints&) const override;
+		[[nodiscard]] bool Equal(const Node& o) const noexcept override
+		{
+			auto p = dynamic_cast<const Div*>(&o);
+			return p and p->l == l and p->r == r;
+		}
+		[[nodiscard]] NodePtr Rebuild(const NodePtr* operands) const override { return Make<Div>(operands[0], operands[1]); }
+
+		[[nodiscard]] std::size_t arity() const noexcept override { return 2; }
+		[[nodiscard]] const NodePtr& operand(std::size_t i) const override { return i == 0 ? l : r; }
 	};
 
 	class Pow final : public Node
 	{
-		std::unique_ptr<Node> l, r;
+		NodePtr l, r;
 	public:
-		Pow(std::unique_ptr<Node>&& l, std::unique_ptr<Node>&& r) noexcept : l(std::move(l)), r(std::move(r)) {}
-
-		[[nodiscard]] std::unique_ptr<Node> Clone() const noexcept override { return std::make_unique<Pow>(l->Clone(), r->Clone()); }
-		[[nodiscard]] std::unique_ptr<Node> Eval(const Symbol&, float value) const override;
-		[[nodiscard]] std::unique_ptr<Node> Derive(const Symbol& s) const override;
-		[[nodiscard]] std::unique_ptr<Node> Simplify() const override;
-		[[nodiscard]] std::string to_string() const override { return "pow(" + l->to_string() + ", " + r->to_string() + ")"; }
+		Pow(NodePtr l, NodePtr r) : Node(HashCombine(HashCombine(static_cast<std::size_t>(OpCode::Pow), l->hash()), r->hash()), l->symbols() | r->symbols()), l(std::move(l)), r(std::move(r)) {}
+
+		static constexpr OpCode code = OpCode::Pow;
+
+		[[nodiscard]] OpCode op() const noexcept override { return code; }
+		[[nodiscard]] std::unique_ptr<Node> Clone() const noexcept override { return std::make_unique<Pow>(l, r); }
+		[[nodiscard]] NodePtr Derive(Derivatives&) const override;
+		[[nodiscard]] NodePtr Rewrite(const NodePtr* operands) const override;
+		[[nodiscard]] static NodePtr Fold(const NodePtr&, const NodePtr&);
+		void Write(Writer& out) const override { out << "pow(" << *l << ", " << *r << ")"; }
+		std::uint32_t Compile(Tape& tape) const override;
+		void Adjoin(const NodePtr& adjoint, Adjoints&) const override;
+		[[nodiscard]] bool Equal(const Node& o) const noexcept override
+		{
+			auto p = dynamic_cast<const Pow*>(&o);
+			return p and p->l == l and p->r == r;
+		}
+		[[nodiscard]] NodePtr Rebuild(const NodePtr* operands) const override { return Make<Pow>(operands[0], operands[1]); }
+
+		[[nodiscard]] std::size_t arity() const noexcept override { return 2; }
+		[[nodiscard]] const NodePtr& operand(std::size_t i) const override { return i == 0 ? l : r; }
 	};
 
 	class Exp final : public Node
 	{
 		friend class Log;
-		std::unique_ptr<Node> node;
+		NodePtr node;
 	public:
-		Exp(std::unique_ptr<Node>&& node) noexcept : node(std::move(node)) {}
-
-		[[nodiscard]] std::unique_ptr<Node> Clone() const noexcept override { return std::make_unique<Exp>(node->Clone()); }
-		[[nodiscard]] std::unique_ptr<Node> Eval(const Symbol&, float value) const override;
-		[[nodiscard]] std::unique_ptr<Node> Derive(const Symbol& s) const override;
-		[[nodiscard]] std::unique_ptr<Node> Simplify() const override;
-		[[nodiscard]] std::string to_string() const override { return "exp(" + node->to_string() + ")"; }
+		Exp(NodePtr node) noexcept : Node(HashCombine(static_cast<std::size_t>(OpCode::Exp), node->hash()), node->symbols()), node(std::move(node)) {}
+
+		static constexpr OpCode code = OpCode::Exp;
+
+		[[nodiscard]] OpCode op() const noexcept override { return code; }
+		[[nodiscard]] std::unique_ptr<Node> Clone() const noexcept override { return std::make_unique<Exp>(node); }
+		[[nodiscard]] NodePtr Derive(Derivatives&) const override;
+		[[nodiscard]] NodePtr Rewrite(const NodePtr* operands) const override;
+		[[nodiscard]] static NodePtr Fold(const NodePtr&);
+		void Write(Writer& out) const override { out << "exp(" << *node << ")"; }
+		std::uint32_t Compile(Tape& tape) const override { return tape.Emit(OpCode::Exp, tape.Compile(*node)); }
+		void Adjoin(const NodePtr& adjoint, Adjoints&) const override;
+		[[nodiscard]] bool Equal(const Node& o) const noexcept override
+		{
+			auto p = dynamic_cast<const Exp*>(&o);
+			return p and p->node == node;
+		}
+		[[nodiscard]] NodePtr Rebuild(const NodePtr* operands) const override { return Make<Exp>(operands[0]); }
+
+		[[nodiscard]] std::size_t arity() const noexcept override { return 1; }
+		[[nodiscard]] const NodePtr& operand(std::size_t) const override { return node; }
 	};
 
 	class Log final : public Node
 	{
 		friend class Exp;
-		std::unique_ptr<Node> node;
+		NodePtr node;
 	public:
-		Log(std::unique_ptr<Node>&& node) noexcept : node(std::move(node)) {}
-
-		[[nodiscard]] std::unique_ptr<Node> Clone() const noexcept override { return std::make_unique<Log>(node->Clone()); }
-		[[nodiscard]] std::unique_ptr<Node> Eval(const Symbol&, float value) const override;
-		[[nodiscard]] std::unique_ptr<Node> Derive(const Symbol& s) const override;
-		[[nodiscard]] std::unique_ptr<Node> Simplify() const override;
-		[[nodiscard]] std::string to_string() const override { return "log(" + node->to_string() + ")"; }
+		Log(NodePtr node) noexcept : Node(HashCombine(static_cast<std::size_t>(OpCode::Log), node->hash()), node->symbols()), node(std::move(node)) {}
+
+		static constexpr OpCode code = OpCode::Log;
+
+		[[nodiscard]] OpCode op() const noexcept override { return code; }
+		[[nodiscard]] std::unique_ptr<Node> Clone() const noexcept override { return std::make_unique<Log>(node); }
+		[[nodiscard]] NodePtr Derive(Derivatives&) const override;
+		[[nodiscard]] NodePtr Rewrite(const NodePtr* operands) const override;
+		[[nodiscard]] static NodePtr Fold(const NodePtr&);
+		void Write(Writer& out) const override { out << "log(" << *node << ")"; }
+		std::uint32_t Compile(Tape& tape) const override { return tape.Emit(OpCode::Log, tape.Compile(*node)); }
+		void Adjoin(const NodePtr& adjoint, Adjoints&) const override;
+		[[nodiscard]] bool Equal(const Node& o) const noexcept override
+		{
+			auto p = dynamic_cast<const Log*>(&o);
+			return p and p->node == node;
+		}
+		[[nodiscard]] NodePtr Rebuild(const NodePtr* operands) const override { return Make<Log>(operands[0]); }
+
+		[[nodiscard]] std::size_t arity() const noexcept override { return 1; }
+		[[nodiscard]] const NodePtr& operand(std::size_t) const override { return node; }
 	};
 }
\ No newline at end of file